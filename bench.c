@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Microbenchmarks of the device stages of a frame of `particles`, each one in
+ * isolation: the dimming pass (image_alpha_kernel), the update and drawing of
+ * the balls (update_balls_kernel) and the readback of the pixels. Times are
+ * measured by the device (profiling events), after a few warm-up runs.
+ * Results are printed as CSV on stdout, and can be saved as a baseline that
+ * later runs are compared to.
+ */
+
+#include <OpenCL/opencl.h>
+#include "opencl_util.h"
+
+static const char * kernel_sources[] = { "particles_kernel.cl" };
+static const char * random_init_kernel = "random_init_kernel";
+static const char * image_alpha_kernel = "image_alpha_kernel";
+static const char * update_balls_kernel = "update_balls_kernel";
+static cl_device_id DEVICE;
+static cl_context CONTEXT;
+static cl_kernel INIT_KERNEL;
+static cl_kernel ALPHA_KERNEL;
+static cl_kernel BALLS_KERNEL;
+static cl_command_queue QUEUE;
+
+
+
+
+
+/* #############################################################################
+ * #                                CONSTANTS                                  #
+ */
+#define N_CHANNELS 4            /* cairo RGB24, as in particles */
+#define MAX_SWEEP 16
+#define MAX_RESULTS 1024
+#define MAX_LINE 256
+#define DEFAULT_N "1000,10000,100000"
+#define DEFAULT_RADII "2,10"
+#define DEFAULT_RESOLUTIONS "400,800,1600"
+#define DEFAULT_REPS 50.0f
+#define DEFAULT_WARMUP 5.0f
+#define DEFAULT_THRESHOLD 0.1f
+#define TRACE 0.15f
+#define DELTA 0.04f
+#define FORCE_Y 100.0f
+#define INIT_SPEED 100.0f
+#define RGB 0x6414ed
+
+
+
+
+
+/* #############################################################################
+ * #                                 HEADERS                                   #
+ */
+/* Setup */
+static int read_args(int argc, const char * argv[]);
+static void print_usage(void);
+static int read_sweep(const char * list, int * values);
+
+/* Benchmarks */
+static int bench_alpha(int res);
+static int bench_update(int n, int radius, int res);
+static int bench_readback(int res);
+static int time_runs(cl_kernel kernel, size_t size, cl_mem read, size_t read_bytes, void * host, double * times);
+static void record(const char * stage, int n, int radius, int res, double * times);
+static int compare_baseline(void);
+
+/* OpenCL */
+static int initialize_opencl_framework(void);
+static void shutdown_opencl_framework(void);
+
+
+
+
+
+/* #############################################################################
+ * #                                   MAIN                                    #
+ */
+/*
+ * Global variables
+ */
+/* Sweeps, as comma separated lists */
+static const char * N_LIST = DEFAULT_N;
+static const char * RADII_LIST = DEFAULT_RADII;
+static const char * RESOLUTIONS_LIST = DEFAULT_RESOLUTIONS;
+/* Runs per measure, not counting the warm-up ones */
+static float REPS = DEFAULT_REPS;
+static float WARMUP = DEFAULT_WARMUP;
+/* Device times of the REPS runs of the current measure, in microseconds */
+static double * TIMES = NULL;
+/* Baseline to compare to, and relative slowdown that counts as a regression */
+static const char * BASELINE = NULL;
+static float THRESHOLD = DEFAULT_THRESHOLD;
+/* Results of this run */
+static int results_count = 0;
+static struct {
+  char key[MAX_LINE];   /* stage,n,radius,res */
+  double median;
+} RESULTS[MAX_RESULTS];
+
+
+/* Main
+ */
+int main(int argc, const char *argv[]) {
+  int n_values[MAX_SWEEP], radii[MAX_SWEEP], resolutions[MAX_SWEEP];
+
+  if (read_args(argc, argv)) {
+    print_usage();
+    return EXIT_FAILURE;
+  }
+  int n_count = read_sweep(N_LIST, n_values);
+  int radii_count = read_sweep(RADII_LIST, radii);
+  int resolutions_count = read_sweep(RESOLUTIONS_LIST, resolutions);
+  if (n_count <= 0 || radii_count <= 0 || resolutions_count <= 0
+      || REPS < 1 || WARMUP < 0) {
+    print_usage();
+    return EXIT_FAILURE;
+  }
+
+  /* on the heap: REPS comes from the command line */
+  TIMES = malloc(sizeof(double) * (size_t)REPS);
+  if (!TIMES) {
+    fprintf(stderr, "out of memory for %d reps\n", (int)REPS);
+    return EXIT_FAILURE;
+  }
+
+  if (initialize_opencl_framework()) {
+    free(TIMES);
+    return EXIT_FAILURE;
+  }
+
+  int err = 0;
+  printf("stage,n,radius,res,reps,mean_us,median_us,min_us,max_us,stddev_us\n");
+  for (int r = 0; r < resolutions_count && !err; ++r) {
+    err |= bench_alpha(resolutions[r]);
+    err |= bench_readback(resolutions[r]);
+    for (int i = 0; i < n_count && !err; ++i)
+    for (int j = 0; j < radii_count && !err; ++j)
+    err |= bench_update(n_values[i], radii[j], resolutions[r]);
+  }
+
+  shutdown_opencl_framework();
+  free(TIMES);
+  if (err) return EXIT_FAILURE;
+  if (BASELINE && compare_baseline()) return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+
+
+
+
+/* #############################################################################
+ * #                                   SETUP                                   #
+ */
+/*
+ * Read arguments from `argv` and stores them correctly.
+ * - n=list the numbers of particles, e.g. n=1000,10000
+ * - radius=list the radii of the particles in pixels
+ * - res=list the resolutions: the frame is res x res pixels
+ * - reps=integer the number of measured runs of each benchmark
+ * - warmup=integer the number of runs before measuring
+ * - baseline=file a CSV file printed by an earlier run, to compare to
+ * - threshold=number the relative slowdown of the median over the baseline
+ *   that counts as a regression (0.1 is 10%)
+ * Returns 0 if the arguments were correctly read and stored.
+ * Returns -1 if the arguments were wrong, or if there were too many arguments.
+ */
+static int read_args(int argc, const char *argv[]) {
+
+  /* keywords to parse */
+  int n = 3; /* number of keywords in the below array */
+  char * args[] = { "reps=", "warmup=", "threshold=" };
+  float * args_p[] = { &REPS, &WARMUP, &THRESHOLD };
+
+  /* keywords to parse as strings */
+  int n_strings = 4; /* number of keywords in the below array */
+  char * string_args[] = { "n=", "radius=", "res=", "baseline=" };
+  const char ** string_args_p[] = { &N_LIST, &RADII_LIST, &RESOLUTIONS_LIST, &BASELINE };
+
+  /* no more than n + n_strings args should be given */
+  if (argc > n + n_strings + 1) return -1;
+
+  for (size_t i = 1; i < argc; ++i) {
+    int found = 0;
+    for (size_t j = 0; j < n; ++j) {
+      if (!memcmp(argv[i], args[j], strlen(args[j]))) {
+        *args_p[j] = strtod((argv[i] + strlen(args[j])), NULL);
+        found = 1;
+        break;
+      }
+    }
+    for (size_t j = 0; j < n_strings && !found; ++j) {
+      if (!memcmp(argv[i], string_args[j], strlen(string_args[j]))) {
+        *string_args_p[j] = argv[i] + strlen(string_args[j]);
+        found = 1;
+      }
+    }
+    if (!found) {
+      fprintf(stderr, "read_args: unknown argument %s\n", argv[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void print_usage(void) {
+    fprintf(stderr, "usage: ./bench [n=list] [radius=list] [res=list] "
+      "[reps=num] [warmup=num] [baseline=file] [threshold=fraction]\n");
+}
+
+/* Parse a comma separated `list` of positive integers into `values`.
+ * Returns the number of values, or -1 if the list is not valid.
+ */
+static int read_sweep(const char * list, int * values) {
+  int count = 0;
+  const char * p = list;
+  while (*p) {
+    char * end;
+    long value = strtol(p, &end, 10);
+    if (end == p || value <= 0 || count == MAX_SWEEP) return -1;
+    values[count++] = (int)value;
+    if (*end == ',') ++end;
+    else if (*end) return -1;
+    p = end;
+  }
+  return count;
+}
+
+
+
+
+
+/* #############################################################################
+ * #                                BENCHMARKS                                 #
+ */
+
+/* Dim a res x res frame with ALPHA_KERNEL.
+ * Returns 0 on success, -1 on failure.
+ */
+static int bench_alpha(int res) {
+  cl_int err;
+  int size = res * res * N_CHANNELS;
+  float trace = TRACE;
+
+  cl_mem pixels = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE, size, NULL, &err);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "failed to create pixels buffer on device\n%s\n",
+      util_error_message(err));
+    return -1;
+  }
+
+  err  = clSetKernelArg(ALPHA_KERNEL, 0, sizeof(cl_mem), &pixels);
+  err |= clSetKernelArg(ALPHA_KERNEL, 1, sizeof(int), &size);
+  err |= clSetKernelArg(ALPHA_KERNEL, 2, sizeof(float), &trace);
+  err |= clSetKernelArg(ALPHA_KERNEL, 3, sizeof(cl_mem), NULL);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "bench_alpha: error setting kernel parameters: %s\n",
+      util_error_message(err));
+    clReleaseMemObject(pixels);
+    return -1;
+  }
+
+  int failed = time_runs(ALPHA_KERNEL, size, NULL, 0, NULL, TIMES);
+  clReleaseMemObject(pixels);
+  if (failed) return -1;
+  record("alpha", 0, 0, res, TIMES);
+  return 0;
+}
+
+/* Move and draw `n` balls of radius `radius` in a res x res frame with
+ * BALLS_KERNEL (generic: no obstacles, no force field, no dissipation).
+ * Returns 0 on success, -1 on failure.
+ */
+static int bench_update(int n, int radius, int res) {
+  cl_int err;
+  float n_balls = n, r = radius, delta = DELTA, heat = 0.0f, sleep_speed = 0.0f;
+  float view = 0.0f;
+  float fx = 0.0f, fy = FORCE_Y, speed = INIT_SPEED, scale = 1.0f;
+  int row_stride = res * N_CHANNELS, n_channels = N_CHANNELS;
+  int no_field = 0, distribution = 1;
+  cl_uint seed = 0, rgb = RGB;
+
+  cl_mem pixels = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
+    row_stride * res, NULL, &err);
+  if (err != CL_SUCCESS) goto buffers_unavailable;
+  cl_mem balls = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
+    sizeof(float) * 4 * n, NULL, &err);
+  if (err != CL_SUCCESS) goto cleanup_pixels;
+
+  /* uniform distribution, so that the balls cover the frame */
+  err  = clSetKernelArg(INIT_KERNEL, 0, sizeof(cl_mem), &balls);
+  err |= clSetKernelArg(INIT_KERNEL, 1, sizeof(float), &n_balls);
+  err |= clSetKernelArg(INIT_KERNEL, 2, sizeof(int), &res);
+  err |= clSetKernelArg(INIT_KERNEL, 3, sizeof(int), &res);
+  err |= clSetKernelArg(INIT_KERNEL, 4, sizeof(float), &r);
+  err |= clSetKernelArg(INIT_KERNEL, 5, sizeof(float), &speed);
+  err |= clSetKernelArg(INIT_KERNEL, 6, sizeof(cl_uint), &seed);
+  err |= clSetKernelArg(INIT_KERNEL, 7, sizeof(int), &distribution);
+  size_t init_size = n;
+  if (err == CL_SUCCESS) {
+    err = clEnqueueNDRangeKernel(QUEUE, INIT_KERNEL, 1, NULL, &init_size,
+      NULL, 0, NULL, NULL);
+  }
+  if (err != CL_SUCCESS) goto cleanup_balls;
+
+  err  = clSetKernelArg(BALLS_KERNEL, 0, sizeof(cl_mem), &balls);
+  err |= clSetKernelArg(BALLS_KERNEL, 1, sizeof(float), &n_balls);
+  err |= clSetKernelArg(BALLS_KERNEL, 2, sizeof(cl_mem), &pixels);
+  err |= clSetKernelArg(BALLS_KERNEL, 3, sizeof(int), &res);
+  err |= clSetKernelArg(BALLS_KERNEL, 4, sizeof(int), &res);
+  err |= clSetKernelArg(BALLS_KERNEL, 5, sizeof(int), &row_stride);
+  err |= clSetKernelArg(BALLS_KERNEL, 6, sizeof(int), &n_channels);
+  err |= clSetKernelArg(BALLS_KERNEL, 7, sizeof(float), &fx);
+  err |= clSetKernelArg(BALLS_KERNEL, 8, sizeof(float), &fy);
+  err |= clSetKernelArg(BALLS_KERNEL, 9, sizeof(float), &r);
+  err |= clSetKernelArg(BALLS_KERNEL, 10, sizeof(float), &delta);
+  err |= clSetKernelArg(BALLS_KERNEL, 11, sizeof(float), &heat);
+  err |= clSetKernelArg(BALLS_KERNEL, 12, sizeof(unsigned int), &rgb);
+  err |= clSetKernelArg(BALLS_KERNEL, 13, sizeof(cl_mem), NULL);
+  err |= clSetKernelArg(BALLS_KERNEL, 14, sizeof(cl_mem), NULL);
+  err |= clSetKernelArg(BALLS_KERNEL, 15, sizeof(int), &no_field);
+  err |= clSetKernelArg(BALLS_KERNEL, 16, sizeof(int), &no_field);
+  err |= clSetKernelArg(BALLS_KERNEL, 17, sizeof(cl_mem), NULL);
+  err |= clSetKernelArg(BALLS_KERNEL, 18, sizeof(cl_uint), &seed);
+  err |= clSetKernelArg(BALLS_KERNEL, 19, sizeof(float), &scale);
+  err |= clSetKernelArg(BALLS_KERNEL, 20, sizeof(cl_mem), NULL);
+  err |= clSetKernelArg(BALLS_KERNEL, 21, sizeof(cl_mem), NULL);
+  err |= clSetKernelArg(BALLS_KERNEL, 22, sizeof(cl_mem), NULL);
+  err |= clSetKernelArg(BALLS_KERNEL, 23, sizeof(float), &sleep_speed);
+  /* the whole world in view: nothing culled */
+  err |= clSetKernelArg(BALLS_KERNEL, 24, sizeof(float), &view);
+  err |= clSetKernelArg(BALLS_KERNEL, 25, sizeof(float), &view);
+  err |= clSetKernelArg(BALLS_KERNEL, 26, sizeof(int), &res);
+  err |= clSetKernelArg(BALLS_KERNEL, 27, sizeof(int), &res);
+  if (err != CL_SUCCESS) goto cleanup_balls;
+
+  if (time_runs(BALLS_KERNEL, n, NULL, 0, NULL, TIMES)) goto cleanup_balls;
+  clReleaseMemObject(balls);
+  clReleaseMemObject(pixels);
+  record("update", n, radius, res, TIMES);
+  return 0;
+
+  cleanup_balls:
+    clReleaseMemObject(balls);
+  cleanup_pixels:
+    clReleaseMemObject(pixels);
+  buffers_unavailable:
+    if (err != CL_SUCCESS) {
+      fprintf(stderr, "bench_update: %s\n", util_error_message(err));
+    }
+    return -1;
+}
+
+/* Read a res x res frame back to the host, as present_frame does.
+ * Returns 0 on success, -1 on failure.
+ */
+static int bench_readback(int res) {
+  cl_int err;
+  size_t size = (size_t)res * res * N_CHANNELS;
+
+  unsigned char * host = malloc(size);
+  if (!host) {
+    fprintf(stderr, "bench_readback: out of memory\n");
+    return -1;
+  }
+  cl_mem pixels = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE, size, NULL, &err);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "failed to create pixels buffer on device\n%s\n",
+      util_error_message(err));
+    free(host);
+    return -1;
+  }
+
+  int failed = time_runs(NULL, 0, pixels, size, host, TIMES);
+  clReleaseMemObject(pixels);
+  free(host);
+  if (failed) return -1;
+  record("readback", 0, 0, res, TIMES);
+  return 0;
+}
+
+/* Run `kernel` over `size` work items, or if `kernel` is NULL read
+ * `read_bytes` of `read` into `host`, WARMUP + REPS times, and store the device
+ * time of the last REPS runs in `times` (in microseconds).
+ * Returns 0 on success, -1 on failure.
+ */
+static int time_runs(cl_kernel kernel, size_t size, cl_mem read, size_t read_bytes, void * host, double * times) {
+  cl_int err;
+  int runs = (int)WARMUP + (int)REPS;
+
+  for (int i = 0; i < runs; ++i) {
+    cl_event event;
+    if (kernel) {
+      err = clEnqueueNDRangeKernel(QUEUE, kernel, 1, NULL, &size,
+        NULL, 0, NULL, &event);
+    }
+    else {
+      err = clEnqueueReadBuffer(QUEUE, read, CL_TRUE, 0, read_bytes, host,
+        0, NULL, &event);
+    }
+    if (err != CL_SUCCESS) {
+      fprintf(stderr, "error launching the benchmark: %s\n", util_error_message(err));
+      return -1;
+    }
+    clWaitForEvents(1, &event);
+
+    cl_ulong start, end;
+    err  = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+      sizeof(cl_ulong), &start, NULL);
+    err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+      sizeof(cl_ulong), &end, NULL);
+    clReleaseEvent(event);
+    if (err != CL_SUCCESS) {
+      fprintf(stderr, "error reading the profiling info: %s\n", util_error_message(err));
+      return -1;
+    }
+    if (i >= (int)WARMUP) times[i - (int)WARMUP] = (end - start) / 1000.0;
+  }
+  return 0;
+}
+
+static int compare_times(const void * a, const void * b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Print the statistics of `times` as a CSV line, and keep the median for the
+ * comparison with the baseline. Sorts `times`.
+ */
+static void record(const char * stage, int n, int radius, int res, double * times) {
+  int reps = (int)REPS;
+  double sum = 0, sum2 = 0;
+
+  qsort(times, reps, sizeof(double), compare_times);
+  for (int i = 0; i < reps; ++i) {
+    sum += times[i];
+    sum2 += times[i] * times[i];
+  }
+  double mean = sum / reps;
+  double median = reps % 2 ? times[reps / 2]
+    : (times[reps / 2 - 1] + times[reps / 2]) / 2;
+  double variance = sum2 / reps - mean * mean;
+
+  printf("%s,%d,%d,%d,%d,%.2f,%.2f,%.2f,%.2f,%.2f\n", stage, n, radius, res,
+    reps, mean, median, times[0], times[reps - 1],
+    variance > 0 ? sqrt(variance) : 0.0);
+  fflush(stdout);
+
+  if (results_count < MAX_RESULTS) {
+    snprintf(RESULTS[results_count].key, MAX_LINE, "%s,%d,%d,%d",
+      stage, n, radius, res);
+    RESULTS[results_count].median = median;
+    ++results_count;
+  }
+}
+
+/* Compare the medians of this run with the ones in the BASELINE file (a CSV
+ * printed by an earlier run). Measures missing from either side are skipped.
+ * Returns 0 if no measure is slower than the baseline by more than THRESHOLD,
+ * -1 otherwise.
+ */
+static int compare_baseline(void) {
+  FILE * f = fopen(BASELINE, "r");
+  if (!f) {
+    fprintf(stderr, "could not open baseline %s\n", BASELINE);
+    return -1;
+  }
+
+  char line[MAX_LINE];
+  int regressions = 0, compared = 0;
+  while (fgets(line, sizeof(line), f)) {
+    char stage[MAX_LINE], key[MAX_LINE];
+    int n, radius, res, reps;
+    double mean, median;
+    if (sscanf(line, "%[^,],%d,%d,%d,%d,%lf,%lf", stage, &n, &radius, &res,
+        &reps, &mean, &median) != 7) {
+      continue;   /* header */
+    }
+    snprintf(key, sizeof(key), "%s,%d,%d,%d", stage, n, radius, res);
+    for (int i = 0; i < results_count; ++i) {
+      if (strcmp(RESULTS[i].key, key)) continue;
+      double change = median > 0 ? RESULTS[i].median / median - 1 : 0;
+      ++compared;
+      if (change > THRESHOLD) {
+        fprintf(stderr, "regression: %s median %.2f us, baseline %.2f us (%+.1f%%)\n",
+          key, RESULTS[i].median, median, 100 * change);
+        ++regressions;
+      }
+      break;
+    }
+  }
+  fclose(f);
+
+  fprintf(stderr, "compared %d measures with %s: %d regressions over %.0f%%\n",
+    compared, BASELINE, regressions, 100 * THRESHOLD);
+  return regressions ? -1 : 0;
+}
+
+
+
+
+
+/* #############################################################################
+ * #                                  OPENCL                                   #
+ */
+
+/* Compile the kernels and create a profiling queue.
+ * Returns 0 on success, -1 on failure.
+ */
+static int initialize_opencl_framework(void) {
+  cl_int err;
+
+  if (util_choose_device(&DEVICE) != 0)
+    goto device_unavailable;
+
+  CONTEXT = clCreateContext(NULL, 1, &DEVICE, NULL, NULL, &err);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "failed to create context\n%s\n", util_error_message(err));
+    goto device_unavailable;
+  }
+
+  if (util_compile_kernel(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+    random_init_kernel, DEVICE, CONTEXT, &INIT_KERNEL) != 0) {
+    goto cleanup_init_kernel;
+  }
+  if (util_compile_kernel(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+    image_alpha_kernel, DEVICE, CONTEXT, &ALPHA_KERNEL) != 0) {
+    goto cleanup_alpha_kernel;
+  }
+  if (util_compile_kernel(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+    update_balls_kernel, DEVICE, CONTEXT, &BALLS_KERNEL) != 0) {
+    goto cleanup_balls_kernel;
+  }
+
+  QUEUE = clCreateCommandQueue(CONTEXT, DEVICE, CL_QUEUE_PROFILING_ENABLE, &err);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "failed to create command queue\n%s\n", util_error_message(err));
+    goto cleanup_queue;
+  }
+  return 0;
+
+  cleanup_queue:
+    clReleaseKernel(BALLS_KERNEL);
+  cleanup_balls_kernel:
+    clReleaseKernel(ALPHA_KERNEL);
+  cleanup_alpha_kernel:
+    clReleaseKernel(INIT_KERNEL);
+  cleanup_init_kernel:
+    clReleaseContext(CONTEXT);
+  device_unavailable:
+    return -1;
+}
+
+/* Cleanup everything.
+ */
+static void shutdown_opencl_framework(void) {
+  clReleaseKernel(BALLS_KERNEL);
+  clReleaseKernel(ALPHA_KERNEL);
+  clReleaseKernel(INIT_KERNEL);
+  clReleaseCommandQueue(QUEUE);
+  clReleaseContext(CONTEXT);
+}
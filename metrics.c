@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+/* Metrics of the frames, written by the frame path (and by the OpenCL event
+ * callbacks) with relaxed atomics only, and read the same way by the server
+ * thread: a scrape may see a frame half recorded, but never blocks one. */
+
+/* Upper bounds of the buckets of the frame time histogram, in milliseconds */
+static const double FRAME_BUCKETS[] = { 1, 2, 5, 10, 20, 40, 80, 160, 320 };
+#define FRAME_BUCKETS_COUNT (sizeof(FRAME_BUCKETS)/sizeof(double))
+
+static const char * STAGE_NAMES[METRICS_STAGES] = {
+  "alpha", "update", "resolve", "readback"
+};
+
+static atomic_uint_fast64_t FRAMES_BUCKETS[FRAME_BUCKETS_COUNT + 1];
+static atomic_uint_fast64_t FRAMES_COUNT;
+static atomic_uint_fast64_t FRAMES_MICROSECONDS;
+static atomic_uint_fast64_t STAGES_COUNT[METRICS_STAGES];
+static atomic_uint_fast64_t STAGES_NANOSECONDS[METRICS_STAGES];
+static atomic_uint_fast64_t READBACK_BYTES;
+static atomic_int PARTICLES;
+static _Atomic float FORCE_X;
+static _Atomic float FORCE_Y;
+static _Atomic float TRACE;
+
+#define MAX_RESPONSE 8192
+#define MAX_REQUEST 1024
+/* Seconds a client may take to send its request or read the answer */
+#define CLIENT_TIMEOUT 2
+
+/* Listening socket, -1 once stopped (the thread has its own copy) */
+static atomic_int SERVER = -1;
+static char SOCKET_PATH[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static void * serve(void * data);
+static size_t format_metrics(char * out, size_t size);
+
+
+int
+metrics_start(const char * path) {
+  struct sockaddr_un address;
+  struct stat status;
+  pthread_t thread;
+  int server;
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "metrics socket path too long: %s\n", path);
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  /* a socket left by a previous run is replaced, anything else is kept */
+  if (!lstat(path, &status)) {
+    if (!S_ISSOCK(status.st_mode)) {
+      fprintf(stderr, "%s exists and is not a socket\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0) {
+    fprintf(stderr, "could not create the metrics socket\n");
+    return -1;
+  }
+  if (bind(server, (struct sockaddr *)&address, sizeof(address))
+      || listen(server, 4)) {
+    fprintf(stderr, "could not listen on the metrics socket %s\n", path);
+    goto cleanup_socket;
+  }
+  strcpy(SOCKET_PATH, path);
+
+  /* a scraper hanging up must not kill the simulation */
+  signal(SIGPIPE, SIG_IGN);
+
+  atomic_store(&SERVER, server);
+  if (pthread_create(&thread, NULL, serve, (void *)(intptr_t)server)) {
+    fprintf(stderr, "could not start the metrics thread\n");
+    goto cleanup_path;
+  }
+  pthread_detach(thread);
+  return 0;
+
+  cleanup_path:
+    atomic_store(&SERVER, -1);
+    unlink(path);
+  cleanup_socket:
+    close(server);
+    return -1;
+}
+
+/* Stop serving: shutting the socket down wakes the thread up in accept (closing
+ * it does not), and the thread closes it.
+ */
+void
+metrics_stop(void) {
+  int server = atomic_exchange(&SERVER, -1);
+  if (server < 0) return;
+  shutdown(server, SHUT_RDWR);
+  unlink(SOCKET_PATH);
+}
+
+void
+metrics_frame(int64_t microseconds) {
+  size_t bucket = 0;
+  while (bucket < FRAME_BUCKETS_COUNT && microseconds > FRAME_BUCKETS[bucket] * 1000)
+    ++bucket;
+  atomic_fetch_add_explicit(&FRAMES_BUCKETS[bucket], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&FRAMES_COUNT, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&FRAMES_MICROSECONDS, microseconds, memory_order_relaxed);
+}
+
+void
+metrics_stage(int stage, uint64_t nanoseconds) {
+  atomic_fetch_add_explicit(&STAGES_COUNT[stage], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&STAGES_NANOSECONDS[stage], nanoseconds, memory_order_relaxed);
+}
+
+void
+metrics_readback(size_t bytes) {
+  atomic_fetch_add_explicit(&READBACK_BYTES, bytes, memory_order_relaxed);
+}
+
+void
+metrics_state(int n, float fx, float fy, float trace) {
+  atomic_store_explicit(&PARTICLES, n, memory_order_relaxed);
+  atomic_store_explicit(&FORCE_X, fx, memory_order_relaxed);
+  atomic_store_explicit(&FORCE_Y, fy, memory_order_relaxed);
+  atomic_store_explicit(&TRACE, trace, memory_order_relaxed);
+}
+
+/* Answer every connection on the listening socket `data` with the metrics,
+ * one at a time, until metrics_stop.
+ */
+static void *
+serve(void * data) {
+  int server = (int)(intptr_t)data;
+  char request[MAX_REQUEST];
+  char response[MAX_RESPONSE];
+  static const char header[] = "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+
+  for (;;) {
+    int client = accept(server, NULL, NULL);
+    if (client < 0) {
+      if (atomic_load(&SERVER) < 0) {
+        close(server);
+        return NULL;
+      }
+      continue;
+    }
+
+    /* a client that stalls must not keep the others waiting */
+    struct timeval timeout = { CLIENT_TIMEOUT, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    /* the request does not matter, but read it before answering */
+    ssize_t length = read(client, request, sizeof(request));
+    if (length >= 0) {
+      size_t body = format_metrics(response, sizeof(response));
+      if (write(client, header, sizeof(header) - 1) > 0) {
+        write(client, response, body);
+      }
+    }
+    close(client);
+  }
+  return NULL;
+}
+
+#define LOAD(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+/* Print the metrics in `out`.
+ * Returns the number of bytes printed.
+ */
+static size_t
+format_metrics(char * out, size_t size) {
+  size_t used = 0;
+  uint64_t cumulative = 0;
+
+  #define PRINT(...) do { \
+    int printed = snprintf(out + used, size - used, __VA_ARGS__); \
+    if (printed > 0) used += ((size_t)printed < size - used) ? (size_t)printed : size - used - 1; \
+  } while (0)
+
+  PRINT("# HELP particles_frame_seconds Cost of the presented frames.\n");
+  PRINT("# TYPE particles_frame_seconds histogram\n");
+  for (size_t i = 0; i < FRAME_BUCKETS_COUNT; ++i) {
+    cumulative += LOAD(FRAMES_BUCKETS[i]);
+    PRINT("particles_frame_seconds_bucket{le=\"%g\"} %llu\n",
+      FRAME_BUCKETS[i] / 1000, (unsigned long long)cumulative);
+  }
+  cumulative += LOAD(FRAMES_BUCKETS[FRAME_BUCKETS_COUNT]);
+  PRINT("particles_frame_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+  PRINT("particles_frame_seconds_sum %f\n", LOAD(FRAMES_MICROSECONDS) / 1e6);
+  PRINT("particles_frame_seconds_count %llu\n", (unsigned long long)LOAD(FRAMES_COUNT));
+
+  PRINT("# HELP particles_stage_seconds_total Device time of each stage of the frames.\n");
+  PRINT("# TYPE particles_stage_seconds_total counter\n");
+  for (int i = 0; i < METRICS_STAGES; ++i) {
+    PRINT("particles_stage_seconds_total{stage=\"%s\"} %f\n",
+      STAGE_NAMES[i], LOAD(STAGES_NANOSECONDS[i]) / 1e9);
+  }
+  PRINT("# HELP particles_stage_runs_total Runs of each stage of the frames.\n");
+  PRINT("# TYPE particles_stage_runs_total counter\n");
+  for (int i = 0; i < METRICS_STAGES; ++i) {
+    PRINT("particles_stage_runs_total{stage=\"%s\"} %llu\n",
+      STAGE_NAMES[i], (unsigned long long)LOAD(STAGES_COUNT[i]));
+  }
+
+  PRINT("# HELP particles_readback_bytes_total Bytes of frames read back from the device.\n");
+  PRINT("# TYPE particles_readback_bytes_total counter\n");
+  PRINT("particles_readback_bytes_total %llu\n", (unsigned long long)LOAD(READBACK_BYTES));
+
+  PRINT("# HELP particles_count Number of particles.\n");
+  PRINT("# TYPE particles_count gauge\n");
+  PRINT("particles_count %d\n", LOAD(PARTICLES));
+  PRINT("# HELP particles_force Force applied to the particles.\n");
+  PRINT("# TYPE particles_force gauge\n");
+  PRINT("particles_force{axis=\"x\"} %f\n", LOAD(FORCE_X));
+  PRINT("particles_force{axis=\"y\"} %f\n", LOAD(FORCE_Y));
+  PRINT("# HELP particles_trace Dimming factor of the traces.\n");
+  PRINT("# TYPE particles_trace gauge\n");
+  PRINT("particles_trace %f\n", LOAD(TRACE));
+
+  #undef PRINT
+  return used;
+}
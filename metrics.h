@@ -0,0 +1,35 @@
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Stages of a frame whose device time is measured */
+#define METRICS_STAGE_ALPHA 0
+#define METRICS_STAGE_UPDATE 1
+#define METRICS_STAGE_RESOLVE 2
+#define METRICS_STAGE_READBACK 3
+#define METRICS_STAGES 4
+
+/* Serve the metrics in the Prometheus text format over HTTP on the UNIX
+ * socket `path`, from a thread of its own. */
+extern int
+metrics_start(const char * path);
+
+extern void
+metrics_stop(void);
+
+/* Recording, from any thread, without locks */
+extern void
+metrics_frame(int64_t microseconds);
+
+extern void
+metrics_stage(int stage, uint64_t nanoseconds);
+
+extern void
+metrics_readback(size_t bytes);
+
+extern void
+metrics_state(int n, float fx, float fy, float trace);
+
+#endif
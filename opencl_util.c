@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <OpenCL/opencl.h>
 
@@ -118,7 +119,7 @@ util_read_file(char ** bytes, size_t * length, const char * filename) {
   return 0;
 }
 
-extern void
+void
 util_print_platform_info(cl_platform_id platform) {
   char buf[1024];
   cl_int err;
@@ -148,6 +149,15 @@ util_print_platform_info(cl_platform_id platform) {
 int
 util_compile_kernel(const char * kernel_sources[], const size_t sources_count,
   const char * kernel_name,
+  cl_device_id device, cl_context context, cl_kernel * kernel) {
+    return util_compile_kernel_with_options(kernel_sources, sources_count,
+      kernel_name, NULL, device, context, kernel);
+  }
+
+int
+util_compile_kernel_with_options(const char * kernel_sources[],
+  const size_t sources_count, const char * kernel_name,
+  const char * options,
   cl_device_id device, cl_context context, cl_kernel * kernel) {
     char * sources_bytes[sources_count];
     size_t sources_length[sources_count];
@@ -171,7 +181,7 @@ util_compile_kernel(const char * kernel_sources[], const size_t sources_count,
       }
 
       // Build the program executable
-      err = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+      err = clBuildProgram(program, 1, &device, options, NULL, NULL);
       if (err != CL_SUCCESS) {
         fprintf(stderr, "failed to create program from source files:");
         if (err == CL_BUILD_PROGRAM_FAILURE) {
@@ -217,6 +227,36 @@ util_compile_kernel(const char * kernel_sources[], const size_t sources_count,
       return 1;
     }
 
+void
+util_reset_kernel_args(struct util_kernel_args * args, cl_kernel kernel) {
+  memset(args, 0, sizeof(*args));
+  args->kernel = kernel;
+}
+
+cl_int
+util_set_kernel_arg(struct util_kernel_args * args, cl_uint index,
+  size_t size, const void * value) {
+  if (index >= UTIL_MAX_KERNEL_ARGS || size > UTIL_MAX_KERNEL_ARG_SIZE)
+  return clSetKernelArg(args->kernel, index, size, value);
+
+  int is_null = (value == NULL);
+  if (args->sizes[index] == size && args->is_null[index] == is_null
+      && (is_null || !memcmp(args->values[index], value, size)))
+  return CL_SUCCESS;
+
+  cl_int err = clSetKernelArg(args->kernel, index, size, value);
+  if (err == CL_SUCCESS) {
+    args->sizes[index] = size;
+    args->is_null[index] = is_null;
+    if (!is_null)
+    memcpy(args->values[index], value, size);
+  }
+  else {
+    args->sizes[index] = 0;
+  }
+  return err;
+}
+
     static const cl_uint MAX_PLATFORMS = 4;
     static const cl_uint MAX_DEVICES = 10;
 
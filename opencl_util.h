@@ -18,6 +18,30 @@ util_compile_kernel(const char * kernel_sources[], const size_t sources_count,
 		    const char * kernel_name,
 		    cl_device_id device, cl_context context, cl_kernel * kernel);
 
+extern int
+util_compile_kernel_with_options(const char * kernel_sources[],
+		    const size_t sources_count, const char * kernel_name,
+		    const char * options,
+		    cl_device_id device, cl_context context, cl_kernel * kernel);
+
+/* Arguments of a kernel as last set, so that setting an argument to the value
+ * it already has is skipped. */
+#define UTIL_MAX_KERNEL_ARGS 32
+#define UTIL_MAX_KERNEL_ARG_SIZE 16
+struct util_kernel_args {
+  cl_kernel kernel;
+  size_t sizes[UTIL_MAX_KERNEL_ARGS];  /* 0 if not set yet */
+  int is_null[UTIL_MAX_KERNEL_ARGS];
+  unsigned char values[UTIL_MAX_KERNEL_ARGS][UTIL_MAX_KERNEL_ARG_SIZE];
+};
+
+extern void
+util_reset_kernel_args(struct util_kernel_args * args, cl_kernel kernel);
+
+extern cl_int
+util_set_kernel_arg(struct util_kernel_args * args, cl_uint index,
+		    size_t size, const void * value);
+
 extern int
 util_choose_device(cl_device_id * device_id);
 
@@ -4,6 +4,11 @@
 #include <limits.h>
 #include <time.h>
 #include <math.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /*  This program uses the Gdk-Pixbuf and Gtk libraries, which are part
  *  of the GIMP Toolkit, a toolkit for graphical user interfaces.  See
@@ -24,16 +29,47 @@
  */
 #include <OpenCL/opencl.h>
 #include "opencl_util.h"
+#include "metrics.h"
 static const char * kernel_sources[] = { "particles_kernel.cl" };
 static const char * random_init_kernel = "random_init_kernel";
 static const char * image_alpha_kernel = "image_alpha_kernel";
 static const char * update_balls_kernel = "update_balls_kernel";
+static const char * random_init_compact_kernel = "random_init_compact_kernel";
+static const char * update_balls_compact_kernel = "update_balls_compact_kernel";
+static const char * compact_divergence_kernel = "compact_divergence_kernel";
+static const char * jfa_init_kernel = "jfa_init_kernel";
+static const char * jfa_step_kernel = "jfa_step_kernel";
+static const char * jfa_distance_kernel = "jfa_distance_kernel";
+static const char * draw_obstacles_kernel = "draw_obstacles_kernel";
+static const char * field_analytic_kernel = "field_analytic_kernel";
+static const char * ensemble_init_kernel = "ensemble_init_kernel";
+static const char * ensemble_update_kernel = "ensemble_update_kernel";
+static const char * ensemble_stats_kernel = "ensemble_stats_kernel";
+static const char * resolve_trails_kernel = "resolve_trails_kernel";
+static const char * active_list_kernel = "active_list_kernel";
+static const char * pack_compact_kernel = "pack_compact_kernel";
 static cl_device_id DEVICE;
 static cl_context CONTEXT;
 static cl_kernel INIT_KERNEL;
 static cl_kernel ALPHA_KERNEL;
 static cl_kernel BALLS_KERNEL;
 static cl_command_queue QUEUE;
+
+/* Arguments last set on the per-frame kernels (see util_set_kernel_arg) */
+static struct util_kernel_args ALPHA_ARGS;
+static struct util_kernel_args BALLS_ARGS;
+static struct util_kernel_args SHADOW_ARGS;
+
+/* Variants of BALLS_KERNEL specialised for a configuration (see
+ * balls_variant) */
+#define MAX_BALLS_VARIANTS 16
+#define MAX_OPTIONS 256
+static struct balls_variant {
+  char options[MAX_OPTIONS];
+  int available;                  /* 0 if it failed to compile */
+  struct util_kernel_args args;
+} BALLS_VARIANTS[MAX_BALLS_VARIANTS];
+static int balls_variants_count = 0;
 /* Flag: if init happened */
 static int opencl_framework_available = 0;
 /* Device memory: pixels (with flag) */
@@ -42,6 +78,49 @@ static int device_pixels_allocated = 0;
 /* Device memory: pixels (with flag) */
 static cl_mem DEVICE_BALLS;
 static int device_balls_allocated = 0;
+/* Compact format check (compact=2): fp32 shadow balls, distances, kernels */
+static cl_kernel SHADOW_INIT_KERNEL;
+static cl_kernel SHADOW_KERNEL;
+static cl_kernel DIVERGENCE_KERNEL;
+static int shadow_kernels_available = 0;
+static cl_mem DEVICE_SHADOW_BALLS;
+static cl_mem DEVICE_DISTANCES;
+static int device_shadow_allocated = 0;
+/* Obstacles (obstacles=file): kernels and signed distance field */
+static cl_kernel JFA_INIT_KERNEL;
+static cl_kernel JFA_STEP_KERNEL;
+static cl_kernel JFA_DISTANCE_KERNEL;
+static cl_kernel OBSTACLES_KERNEL;
+static int obstacle_kernels_available = 0;
+static cl_mem DEVICE_SDF;
+static int device_sdf_allocated = 0;
+/* Force field: kernel for analytic fields, grid of (fx, fy) and its size */
+static cl_kernel FIELD_KERNEL;
+static cl_mem DEVICE_FIELD;
+static int device_field_allocated = 0;
+static int device_field_cols = 0;
+static int device_field_rows = 0;
+/* Force field read from a file: host copy, kept until `FIELD_WRITTEN` */
+static float * FIELD_HOST = NULL;
+static cl_event FIELD_WRITTEN = NULL;
+
+static cl_kernel RESOLVE_KERNEL;
+static int trail_kernels_available = 0;
+static cl_mem DEVICE_COLOURS;
+static cl_mem DEVICE_STAMPS;
+static int device_trails_allocated = 0;
+
+static cl_kernel ACTIVE_KERNEL;
+static int sleep_kernels_available = 0;
+static cl_mem DEVICE_SLEEP;
+static cl_mem DEVICE_ACTIVE;
+static cl_mem DEVICE_ACTIVE_COUNT;
+static int device_sleep_allocated = 0;
+static cl_mem DEVICE_REST;
+static int device_rest_allocated = 0;
+
+static cl_kernel PACK_KERNEL;
+static int pack_kernel_available = 0;
 
 
 
@@ -50,25 +129,97 @@ static int device_balls_allocated = 0;
  */
 /* Window */
 #define WINDOW_IS_RESIZABLE 1
+/* Presentation: 1 renders into a cairo image surface in the native 32-bit
+ * xRGB format, 0 renders into a 24-bit RGB GdkPixbuf */
+#define PRESENT_WITH_CAIRO 1
 #define DEFAULT_WIDTH 800
 #define DEFAULT_HEIGHT 800
+/* World, in which the balls move (0 is the size of the window), and the view
+ * of it: bounds and step of the zoom, and pan step as a fraction of the view */
+#define DEFAULT_WORLD_WIDTH 0.0f
+#define DEFAULT_WORLD_HEIGHT 0.0f
+#define MIN_ZOOM 0.01f
+#define MAX_ZOOM 16.0f
+#define ZOOM_STEP 1.25f
+#define PAN_STEP 0.1f
 /* Simulation */
 #define DEFAULT_N_PARTICLES 100.0f
 #define DEFAULT_TRACE 0.15f
 #define DEFAULT_RADIUS 10.0f
 #define DEFAULT_DELTA 0.04f
 #define MILLI 1000.0f
+#define MICRO 1000000.0f
 #define PRECISION 0.05f
 /* Physics */
 #define DEFAULT_FORCE_X 0.0f
 #define DEFAULT_FORCE_Y 100.0f
 #define FORCE 10.0f
 #define DEFAULT_INIT_SPEED 100.0f
+/* Initial distribution: 0 spiral, 1 uniform, 2 gaussian blob, 3 Maxwell-Boltzmann */
+#define DEFAULT_DISTRIBUTION 0.0f
+#define DEFAULT_SEED 0.0f
 #define DEFAULT_DISSIPATION 0.0f
+/* Force fields: sources (cycled with F), grid size and magnitude of the
+ * analytic ones */
+#define FIELD_NONE 0
+#define FIELD_FILE 1
+#define FIELD_VORTEX 2
+#define FIELD_SINK 3
+#define FIELD_GRID 64
+#define FIELD_STRENGTH 200.0f
+/* Ensembles: steps simulated, work-group size of the statistics (passed to
+ * the kernels, see KERNEL_CONSTANTS) */
+#define DEFAULT_STEPS 1000.0f
+#define ENSEMBLE_GROUP 64
+/* State format: 0 fp32, 1 compact, 2 compact checked against fp32 */
+#define DEFAULT_COMPACT 0.0f
+/* Trails: 0 dimmed at every step, 1 resolved from the age of each pixel when
+ * presented */
+#define DEFAULT_LAZY 0.0f
+/* Sleeping balls: speed under which a ball counts as still (0 is off), steps
+ * it has to stay still to fall asleep, and work-group size of the list of
+ * the awake balls (both passed to the kernels, see KERNEL_CONSTANTS) */
+#define DEFAULT_SLEEP_SPEED 0.0f
+#define SLEEP_STEPS 30
+#define ACTIVE_GROUP 64
+/* Particle files (load=): a header, then `count` balls as (x, y, vx, vy)
+ * native-endian floats, uploaded LOAD_CHUNK bytes at a time */
+#define PARTICLES_MAGIC 0x50415254    /* "PART" */
+#define PARTICLES_VERSION 1
+#define LOAD_CHUNK (16 << 20)
+struct particles_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t count;
+};
+/* Frame scheduler: most simulated time it can owe before dropping it, and
+ * interval of the frame statistics (in seconds) */
+#define MAX_LAG 0.25f
+#define MAX_DROPPED_FRAMES 4
+#define FRAME_STATS_INTERVAL 5.0f
+/* Dynamic resolution (target_ms=): the mean cost of RENDER_WINDOW presented
+ * frames is compared with the target; above it the render scale is multiplied
+ * by RENDER_SCALE_STEP, below RENDER_HEADROOM times the target it is divided
+ * by it. RENDER_HEADROOM is below RENDER_SCALE_STEP^2, so that going up one
+ * step is not expected to go over the target again */
+#define DEFAULT_TARGET_MS 0.0f
+#define MIN_RENDER_SCALE 0.25f
+#define RENDER_SCALE_STEP 0.8f
+#define RENDER_HEADROOM 0.6f
+#define RENDER_WINDOW 10
 /* Colours */
 #define DEFAULT_R 100
 #define DEFAULT_G 20
 #define DEFAULT_B 237
+#define OBSTACLES_RGB 0x505050
+/* Obstacles: mask pixels brighter than this are obstacles */
+#define OBSTACLES_THRESHOLD 127
+/* Constants shared with the kernels, defined above only and given to every
+ * build of particles_kernel.cl as -D options */
+#define KERNEL_STRING(value) #value
+#define KERNEL_CONSTANT(name) " -D " #name "=" KERNEL_STRING(name)
+#define KERNEL_CONSTANTS KERNEL_CONSTANT(SLEEP_STEPS) KERNEL_CONSTANT(ACTIVE_GROUP) \
+  KERNEL_CONSTANT(ENSEMBLE_GROUP) KERNEL_CONSTANT(FIELD_VORTEX) KERNEL_CONSTANT(FIELD_SINK)
 
 
 
@@ -83,23 +234,81 @@ void print_usage(void);
 
 /* Tick */
 static void randomize_balls(void);
+static int init_balls(cl_kernel kernel, cl_mem balls);
 static gboolean update_and_draw_balls(GtkWidget * widget);
+static int step_balls(void);
+static gboolean schedule_frame(GtkWidget * widget);
+static void record_frame(gint64 start, gint64 presented);
+static void adapt_render_scale(gint64 cost);
 static int alpha(void);
+static int resolve_trails(void);
+static int list_active_balls(void);
+static void wake_balls(void);
+static int is_quiescent(void);
+static int fade_steps(void);
+static int clear_buffer(cl_mem buffer, size_t size);
 static int move_balls(void);
+static int move_balls_with(struct util_kernel_args * kernel, cl_mem balls, int draw);
+static struct util_kernel_args * balls_variant(void);
+static void print_compact_divergence(int frame);
 int draw_image(GtkWidget * widget);
 
+/* Force fields */
+static int set_field(int source);
+static int field_is_file(void);
+static int allocate_device_field(int cols, int rows);
+static int load_field_file(void);
+static int compute_analytic_field(int type);
+
+/* Ensembles */
+static int run_ensemble(void);
+static float * read_sweep(int * members);
+
+/* Obstacles */
+static int load_obstacles(void);
+static int compute_sdf(void);
+static int draw_obstacles(void);
+
+/* Particle files */
+static int map_particles_file(void);
+static int load_balls(void);
+static void advise_chunk(const char * start, const char * end);
+
 /* Controls */
 static void destroy_window(void);
 static gint keyboard_input(GtkWidget * widget, GdkEventKey * event);
 #if WINDOW_IS_RESIZABLE
-static gint resize_pixbuf(GtkWidget * widget, GdkEventConfigure * event);
+static gint resize_frame(GtkWidget * widget, GdkEventConfigure * event);
 #endif
 
+/* Frame */
+static void allocate_frame(int width, int height);
+static void set_render_scale(float scale);
+static int frame_width(void);
+static int frame_height(void);
+static int frame_row_stride(void);
+static int frame_n_channels(void);
+static unsigned char * frame_pixels(void);
+static void present_frame(GtkWidget * widget);
+static int world_width(void);
+static int world_height(void);
+static void set_view(float x, float y, float zoom);
+static void zoom_view(float zoom);
+
 /* OpenCL */
 static void initialize_opencl_framework(void);
+static void initialize_shadow_kernels(void);
+static void initialize_obstacle_kernels(void);
+static void initialize_trail_kernels(void);
+static void initialize_sleep_kernels(void);
+static void initialize_load_kernels(void);
 static void shutdown_opencl_framework(void);
 static void allocate_device_pixels(void);
 static void allocate_device_balls(void);
+static void forget_kernel_args(void);
+static size_t ball_size(void);
+static void profile_stage(int stage, cl_event event);
+static void CL_CALLBACK stage_profiled(cl_event event, cl_int status, void * data);
 
 /* Util */
 static void print_balls(void);
@@ -116,8 +325,12 @@ static gint remover; /* used by the above function */
 /*
  * Global variables
  */
-/* Pixbuf for image */
+/* Frame for image: a cairo surface or a pixbuf (see PRESENT_WITH_CAIRO) */
+#if PRESENT_WITH_CAIRO
+static cairo_surface_t * SURFACE = NULL;
+#else
 static GdkPixbuf * PIXBUF = NULL;
+#endif
 /* Set default simulation values */
 static float N = DEFAULT_N_PARTICLES;
 static float TRACE = DEFAULT_TRACE;
@@ -125,9 +338,67 @@ static float RADIUS = DEFAULT_RADIUS;
 static float DELTA = DEFAULT_DELTA;
 /* Set default physics values */
 static float INIT_SPEED = DEFAULT_INIT_SPEED;
+static float DISTRIBUTION = DEFAULT_DISTRIBUTION;
+static float SEED = DEFAULT_SEED;
 static float DISSIPATION = DEFAULT_DISSIPATION;
 static float FX = DEFAULT_FORCE_X;
 static float FY = DEFAULT_FORCE_Y;
+static float COMPACT = DEFAULT_COMPACT;
+/* Particle file: name, and its mapping until the balls are loaded */
+static const char * LOAD = NULL;
+static void * LOAD_MAP = NULL;
+static size_t LOAD_SIZE = 0;
+/* Trails: lazy or not, and the current step (see resolve_trails) */
+static float LAZY = DEFAULT_LAZY;
+static cl_uint TRAIL_NOW = 0;
+/* Window, and frame size over window size */
+static int WINDOW_WIDTH = DEFAULT_WIDTH;
+static int WINDOW_HEIGHT = DEFAULT_HEIGHT;
+static float RENDER_SCALE = 1.0f;
+/* World, in which the balls move (0 follows the window, see world_width), and
+ * the view of it: world coordinates of the top left of the window, and window
+ * pixels per world pixel */
+static float WORLD_WIDTH = DEFAULT_WORLD_WIDTH;
+static float WORLD_HEIGHT = DEFAULT_WORLD_HEIGHT;
+static float VIEW_X = 0.0f;
+static float VIEW_Y = 0.0f;
+static float ZOOM = 1.0f;
+static float TARGET_MS = DEFAULT_TARGET_MS;
+/* Sleeping balls: threshold, balls awake at the last step, steps since the
+ * last one fell asleep, and the window while the loop is idle */
+static float SLEEP_SPEED = DEFAULT_SLEEP_SPEED;
+static int ACTIVE_BALLS = 0;
+static int QUIET_STEPS = 0;
+static GtkWidget * IDLE_WIDGET = NULL;
+/* Obstacles: file name of the mask, and the mask itself */
+static const char * OBSTACLES = NULL;
+static GdkPixbuf * OBSTACLES_MASK = NULL;
+/* Force field: `vortex`, `sink` or a file name, and the current source */
+static const char * FIELD = NULL;
+static int FIELD_SOURCE = FIELD_NONE;
+/* Ensembles: file of the parameter sweep, number of steps */
+static const char * SWEEP = NULL;
+static float STEPS = DEFAULT_STEPS;
+/* Metrics: UNIX socket to serve them on (see metrics_start), or NULL */
+static const char * METRICS = NULL;
+/* Frame scheduler (times in microseconds, from g_get_monotonic_time) */
+static gint64 LAST_TICK = 0;
+static gint64 LAG = 0;           /* simulated time owed to the wall clock */
+static gint64 INPUT_TIME = 0;    /* last key press not yet presented, or 0 */
+static struct {
+  int presented;
+  int dropped;
+  gint64 lag_dropped;
+  gint64 last_presented;
+  int intervals;
+  double interval_sum;
+  double interval_sum2;
+  double latency_sum;
+  gint64 latency_max;
+  int latencies;
+  double cost_sum;
+  gint64 start;
+} FRAME_STATS;
 /* Set default graphics values */
 static unsigned int R = DEFAULT_R;
 static unsigned int G = DEFAULT_G;
@@ -138,31 +409,60 @@ static unsigned int B = DEFAULT_B;
  */
 int main(int argc, const char *argv[]) {
 
-  /* Init OpenCL */
-  initialize_opencl_framework();
-
   /* Read arguments, if failed print usage */
   if (read_args(argc, argv)) {
     print_usage();
     return EXIT_FAILURE;
   }
-  printf("n=%f\nfx=%f\nfy=%f\ntrace=%f\nradius=%f\ndelta=%f\nspeed=%f\n",
-    N, FX, FY, TRACE, RADIUS, DELTA, INIT_SPEED);
 
-  /* Allocate pixbuf for image, allocate space on device for copy */
-  PIXBUF = gdk_pixbuf_new(GDK_COLORSPACE_RGB, 0, 8,
-    DEFAULT_WIDTH, DEFAULT_HEIGHT);
+  /* The number of balls of a particle file overrides n= */
+  if (LOAD && !SWEEP && map_particles_file()) return EXIT_FAILURE;
+  printf("n=%f\nfx=%f\nfy=%f\ntrace=%f\nradius=%f\ndelta=%f\nspeed=%f\n"
+    "compact=%f\ninit=%f\nseed=%f\nobstacles=%s\nfield=%s\nlazy=%f\n"
+    "target_ms=%f\nsleep=%f\nmetrics=%s\nworld_w=%f\nworld_h=%f\n",
+    N, FX, FY, TRACE, RADIUS, DELTA, INIT_SPEED, COMPACT, DISTRIBUTION, SEED,
+    OBSTACLES ? OBSTACLES : "none", FIELD ? FIELD : "none", LAZY, TARGET_MS,
+    SLEEP_SPEED, METRICS ? METRICS : "none", WORLD_WIDTH, WORLD_HEIGHT);
+
+  /* Init OpenCL (the kernels depend on the arguments) */
+  initialize_opencl_framework();
+
+  /* Parameter sweeps run without a window */
+  if (SWEEP) return run_ensemble() ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  /* Allocate frame for image, allocate space on device for copy */
+  allocate_frame(DEFAULT_WIDTH, DEFAULT_HEIGHT);
   allocate_device_pixels();
 
   /* Allocate space for balls data (x, y, dx, dy) on device, then call the first
-   * kernel (INIT_KERNEL) to randomise the data.
+   * kernel (INIT_KERNEL) to randomise the data, or load them from a file.
    * This kernel will never be called again.
    */
   allocate_device_balls();
-  randomize_balls();
+  if (LOAD) {
+    if (load_balls()) return EXIT_FAILURE;
+  }
+  else {
+    randomize_balls();
+  }
+
+  /* Set up the force field, if any */
+  if (field_is_file()) {
+    if (set_field(FIELD_FILE)) return EXIT_FAILURE;
+  }
+  else if (FIELD) {
+    set_field(!strcmp(FIELD, "vortex") ? FIELD_VORTEX : FIELD_SINK);
+  }
+
+  /* Serve the metrics, from their own thread */
+  if (METRICS && metrics_start(METRICS)) return EXIT_FAILURE;
 
   /* Initialise GTK */
   gtk_init(0, 0);
+
+  /* Load the obstacles, if any, and compute their distance field (this needs
+   * Gdk-Pixbuf, thus GTK, to be initialised) */
+  if (load_obstacles()) return EXIT_FAILURE;
   GtkWidget * window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
   gtk_window_resize(GTK_WINDOW(window), DEFAULT_WIDTH, DEFAULT_HEIGHT);
   gtk_window_set_title(GTK_WINDOW(window), "Particles");
@@ -171,7 +471,7 @@ int main(int argc, const char *argv[]) {
   gtk_signal_connect(GTK_OBJECT(window), "destroy", GTK_SIGNAL_FUNC(destroy_window), NULL);
   gtk_signal_connect(GTK_OBJECT(window), "key_press_event", GTK_SIGNAL_FUNC(keyboard_input), NULL);
   #if WINDOW_IS_RESIZABLE
-  gtk_signal_connect(GTK_OBJECT(window), "configure_event", GTK_SIGNAL_FUNC(resize_pixbuf), NULL);
+  gtk_signal_connect(GTK_OBJECT(window), "configure_event", GTK_SIGNAL_FUNC(resize_frame), NULL);
   #endif
 
   /* Show window, set timeout, start main */
@@ -179,8 +479,8 @@ int main(int argc, const char *argv[]) {
   gtk_widget_show_all(window);
   gtk_window_set_keep_above(GTK_WINDOW(window), TRUE);
   gtk_window_present(GTK_WINDOW(window));
-  gtk_timeout_add(MILLI * DELTA, (GSourceFunc) update_and_draw_balls,
-    (gpointer) window);
+  LAST_TICK = FRAME_STATS.start = g_get_monotonic_time();
+  g_timeout_add(MILLI * DELTA, (GSourceFunc) schedule_frame, (gpointer) window);
 
   remover = gtk_timeout_add(MILLI * DELTA, (GSourceFunc) remove_keep_above,
     (gpointer) window);
@@ -188,6 +488,7 @@ int main(int argc, const char *argv[]) {
   /* Draw initial image and call gtk main */
   draw_image(window);
   gtk_main();
+  metrics_stop();
 
   // gtk_window_set_keep_above(GTK_WINDOW(window), FALSE);
 
@@ -214,18 +515,60 @@ int main(int argc, const char *argv[]) {
  * - radius=number radius of the particles in pixels.
  * - delta=time-in-seconds inter-frame interval.
  * - speed=number the initial speed of the balls.
+ * - compact=0|1|2 the format of the balls on the device: 0 is fp32 (16 bytes
+ *   per ball), 1 is compact (8 bytes per ball), 2 is compact and also runs a
+ *   fp32 copy of the simulation to print how far the two drift apart.
+ * - init=0|1|2|3 the initial distribution of the balls: 0 is a spiral from the
+ *   centre, 1 is uniform, 2 is a gaussian blob at the centre, 3 is uniform with
+ *   Maxwell-Boltzmann velocities.
+ * - seed=integer the seed for the random initial distributions (up to 2^24).
+ * - obstacles=file an image (PGM, PNG, ...) whose bright pixels are obstacles
+ *   the balls bounce off. It is stretched to the world.
+ * - field=vortex|sink|file a force field added to (fx, fy): a vortex or a sink
+ *   at the centre of the world, or a grid read from a file (see
+ *   load_field_file).
+ * - sweep=file run an ensemble of simulations, one per line of the file, for
+ *   `steps` steps without a window, and print their statistics (see
+ *   run_ensemble).
+ * - steps=integer the number of steps of an ensemble.
+ * - lazy=0|1 how the trails fade: 0 dims the whole frame at every step, 1
+ *   keeps the step at which each pixel was drawn and dims it only when the
+ *   frame is presented (see resolve_trails).
+ * - target_ms=number a budget for the cost of a frame in milliseconds: the
+ *   frame is rendered at a lower resolution, and stretched to the window,
+ *   while frames cost more than that (see adapt_render_scale). 0 is off.
+ * - load=file start from the balls in a particle file instead of a random
+ *   distribution (see map_particles_file). `n` is the number of balls in it.
+ * - sleep=number a speed in pixels/s: balls slower than that for SLEEP_STEPS
+ *   steps fall asleep until the next key press (see list_active_balls). 0 is
+ *   off.
+ * - metrics=path serve metrics in the Prometheus text format on the UNIX
+ *   socket `path` (see metrics.h), e.g. for
+ *   `curl --unix-socket path http://localhost/metrics`.
+ * - world_w=number, world_h=number the size of the world the balls move in,
+ *   in pixels, seen through the window (see set_view). 0 is the size of the
+ *   window.
  * Returns 0 if the arguments were correctly read and stored.
  * Returns -1 if the arguments were wrong, or if there were too many arguments.
  */
 int read_args(int argc, const char *argv[]) {
 
   /* keywords to parse */
-  int n = 7; /* number of keywords in the below array */
-  char * args[] = { "n=", "fx=", "fy=", "trace=", "radius=", "delta=", "speed="};
-  float * args_p[] = { &N, &FX, &FY, &TRACE, &RADIUS, &DELTA, &INIT_SPEED};
-
-  /* no more than 6 args should be given */
-  if (argc > n + 1) return -1;
+  int n = 16; /* number of keywords in the below array */
+  char * args[] = { "n=", "fx=", "fy=", "trace=", "radius=", "delta=", "speed=",
+    "compact=", "init=", "seed=", "steps=", "lazy=", "target_ms=", "sleep=",
+    "world_w=", "world_h="};
+  float * args_p[] = { &N, &FX, &FY, &TRACE, &RADIUS, &DELTA, &INIT_SPEED,
+    &COMPACT, &DISTRIBUTION, &SEED, &STEPS, &LAZY, &TARGET_MS, &SLEEP_SPEED,
+    &WORLD_WIDTH, &WORLD_HEIGHT};
+
+  /* keywords to parse as strings */
+  int n_strings = 5; /* number of keywords in the below array */
+  char * string_args[] = { "obstacles=", "field=", "sweep=", "load=", "metrics=" };
+  const char ** string_args_p[] = { &OBSTACLES, &FIELD, &SWEEP, &LOAD, &METRICS };
+
+  /* no more than n + n_strings args should be given */
+  if (argc > n + n_strings + 1) return -1;
 
   /* search for args */
   for (size_t i = 1; i < argc; ++i) {
@@ -240,6 +583,12 @@ int read_args(int argc, const char *argv[]) {
         break;
       }
     }
+    for (size_t j = 0; j < n_strings && !found; ++j) {
+      if (!memcmp(argv[i], string_args[j], strlen(string_args[j]))) {
+        *string_args_p[j] = argv[i] + strlen(string_args[j]);
+        found = 1;
+      }
+    }
     if (!found) {
       printf("read_args: unknown argument %s\n", argv[i]);
     }
@@ -250,7 +599,10 @@ int read_args(int argc, const char *argv[]) {
 void print_usage(void) {
     fprintf(stderr, "usage: ./particles [n=num_particles] [fx=force_x] "
       "[fy=force_y] [trace=shading] [radius=ball_r] [delta=sec_x_frame]"
-      "[speed=num]\n");
+      "[speed=num] [compact=0|1|2] [init=0|1|2|3] [seed=num] "
+      "[obstacles=file] [field=vortex|sink|file] [sweep=file] [steps=num] "
+      "[lazy=0|1] [target_ms=num] [sleep=speed] [load=file] [metrics=path] "
+      "[world_w=pixels] [world_h=pixels]\n");
 };
 
 
@@ -261,67 +613,243 @@ void print_usage(void) {
  * #                                  RUNNING                                  #
  */
 
-/* Randomise data of balls
+/* Randomise data of balls (and of the fp32 shadow balls, if any)
 */
 static void randomize_balls(void) {
+  if (init_balls(INIT_KERNEL, DEVICE_BALLS)) return;
+  if (device_shadow_allocated) init_balls(SHADOW_INIT_KERNEL, DEVICE_SHADOW_BALLS);
+
+  /* Wait for kernel to finish */
+  clFinish(QUEUE);
+
+  /* used for debug */
+  // print_balls();
+}
+
+/* Launch the init `kernel` on `balls`.
+ * Returns 0 on success, -1 on failure.
+ */
+static int init_balls(cl_kernel kernel, cl_mem balls) {
   cl_int err;
 
-  int width = gdk_pixbuf_get_width(PIXBUF);
-  int height = gdk_pixbuf_get_height(PIXBUF);
+  int width = world_width();
+  int height = world_height();
+  cl_uint seed = (cl_uint) SEED;
+  int distribution = (int) DISTRIBUTION;
 
-  err  = clSetKernelArg(INIT_KERNEL, 0, sizeof(cl_mem), &DEVICE_BALLS);
-  err |= clSetKernelArg(INIT_KERNEL, 1, sizeof(float), &N);
-  err |= clSetKernelArg(INIT_KERNEL, 2, sizeof(int), &width);
-  err |= clSetKernelArg(INIT_KERNEL, 3, sizeof(int), &height);
-  err |= clSetKernelArg(INIT_KERNEL, 4, sizeof(float), &RADIUS);
-  err |= clSetKernelArg(INIT_KERNEL, 5, sizeof(float), &INIT_SPEED);
+  err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &balls);
+  err |= clSetKernelArg(kernel, 1, sizeof(float), &N);
+  err |= clSetKernelArg(kernel, 2, sizeof(int), &width);
+  err |= clSetKernelArg(kernel, 3, sizeof(int), &height);
+  err |= clSetKernelArg(kernel, 4, sizeof(float), &RADIUS);
+  err |= clSetKernelArg(kernel, 5, sizeof(float), &INIT_SPEED);
+  err |= clSetKernelArg(kernel, 6, sizeof(cl_uint), &seed);
+  err |= clSetKernelArg(kernel, 7, sizeof(int), &distribution);
 
   if (err != CL_SUCCESS) {
     fprintf(stderr, "randomize_balls: error setting kernel parameters: %s\n", util_error_message(err));
-    return;
+    return -1;
   }
 
   size_t init_kernel_size = (size_t)N;
-  err = clEnqueueNDRangeKernel(QUEUE, INIT_KERNEL, 1, NULL, &init_kernel_size,
+  err = clEnqueueNDRangeKernel(QUEUE, kernel, 1, NULL, &init_kernel_size,
     NULL, 0, NULL, NULL);
 
-  /* Wait for kernel to finish */
-  clFinish(QUEUE);
-
-  /* used for debug */
-  // print_balls();
-
   if (err != CL_SUCCESS) {
     fprintf(stderr, "error launching the kernel: %s\n", util_error_message(err));
-    return;
+    return -1;
   }
-  return;
+  return 0;
+}
+
+/* Frame scheduler: the simulation advances by fixed steps of DELTA, as many as
+ * the wall clock time since the last call (plus what was owed) covers, then
+ * presents the frame. When it falls behind (steps take longer than DELTA), it
+ * skips presenting and steps again right away, so physics keeps up with the
+ * wall clock at the expense of presented frames (but never more than
+ * MAX_DROPPED_FRAMES in a row). If it owes more than MAX_LAG of simulated time,
+ * the rest is dropped instead.
+ * It then calls itself back when the next step is due.
+ * Returns FALSE, to remove the timeout that called it.
+ */
+static gboolean schedule_frame(GtkWidget * widget) {
+  static int dropped = 0;   /* presentations dropped in a row */
+  gint64 start = g_get_monotonic_time();
+  gint64 step = (gint64)(DELTA * MICRO);
+
+  /* Nothing moves and the last frame was presented: idle until wake_balls */
+  if (is_quiescent()) {
+    IDLE_WIDGET = widget;
+    return FALSE;
+  }
+
+  LAG += start - LAST_TICK;
+  LAST_TICK = start;
+  if (LAG > (gint64)(MAX_LAG * MICRO)) {
+    FRAME_STATS.lag_dropped += LAG - (gint64)(MAX_LAG * MICRO);
+    LAG = (gint64)(MAX_LAG * MICRO);
+  }
+
+  /* Physics: catch up with the wall clock */
+  while (LAG >= step) {
+    if (step_balls()) return FALSE;
+    LAG -= step;
+  }
+
+  /* Still behind (stepping took longer than a step): drop this presentation */
+  LAG += g_get_monotonic_time() - LAST_TICK;
+  LAST_TICK = g_get_monotonic_time();
+  if (LAG >= step && dropped < MAX_DROPPED_FRAMES) {
+    ++dropped;
+    ++FRAME_STATS.dropped;
+    g_timeout_add(0, (GSourceFunc) schedule_frame, (gpointer) widget);
+    return FALSE;
+  }
+
+  /* Presentation */
+  dropped = 0;
+  if (draw_image(widget)) return FALSE;
+  gdk_flush();
+  gint64 presented = g_get_monotonic_time();
+  record_frame(start, presented);
+  metrics_frame(presented - start);
+  metrics_state((int)N, FX, FY, TRACE);
+  adapt_render_scale(g_get_monotonic_time() - start);
+
+  /* Next step is due in `step - LAG` */
+  g_timeout_add(LAG < step ? (guint)((step - LAG) / (MICRO / MILLI)) : 0,
+    (GSourceFunc) schedule_frame, (gpointer) widget);
+  return FALSE;
+}
+
+/* Record a frame that started at `start` and was presented at `presented` in
+ * FRAME_STATS, and the latency of the last key press if there was one. Every
+ * FRAME_STATS_INTERVAL seconds, print the statistics and start over.
+ */
+static void record_frame(gint64 start, gint64 presented) {
+  if (FRAME_STATS.last_presented) {
+    double interval = (double)(presented - FRAME_STATS.last_presented);
+    FRAME_STATS.interval_sum += interval;
+    FRAME_STATS.interval_sum2 += interval * interval;
+    ++FRAME_STATS.intervals;
+  }
+  FRAME_STATS.last_presented = presented;
+  FRAME_STATS.cost_sum += (double)(presented - start);
+  ++FRAME_STATS.presented;
+
+  if (INPUT_TIME) {
+    gint64 latency = presented - INPUT_TIME;
+    FRAME_STATS.latency_sum += latency;
+    if (latency > FRAME_STATS.latency_max) FRAME_STATS.latency_max = latency;
+    ++FRAME_STATS.latencies;
+    INPUT_TIME = 0;
+  }
+
+  if (presented - FRAME_STATS.start < (gint64)(FRAME_STATS_INTERVAL * MICRO)) return;
+
+  int intervals = FRAME_STATS.intervals;
+  double mean = intervals > 0 ? FRAME_STATS.interval_sum / intervals : 0;
+  double variance = intervals > 0 ? FRAME_STATS.interval_sum2 / intervals - mean * mean : 0;
+  printf("FRAMES: %d presented, %d dropped, %f ms simulated time dropped, "
+    "cost %f ms, interval %f ms, jitter %f ms",
+    FRAME_STATS.presented, FRAME_STATS.dropped, FRAME_STATS.lag_dropped / 1e3,
+    FRAME_STATS.cost_sum / FRAME_STATS.presented / 1e3, mean / 1e3,
+    sqrt(variance > 0 ? variance : 0) / 1e3);
+  if (FRAME_STATS.latencies) {
+    printf(", input latency %f ms (max %f ms)",
+      FRAME_STATS.latency_sum / FRAME_STATS.latencies / 1e3,
+      FRAME_STATS.latency_max / 1e3);
+  }
+  printf("\n");
+
+  memset(&FRAME_STATS, 0, sizeof(FRAME_STATS));
+  FRAME_STATS.start = presented;
+  FRAME_STATS.last_presented = presented;
+}
+
+/* With target_ms=, lower the resolution of the frame when presented frames
+ * cost more than TARGET_MS, and raise it again when there is headroom (see
+ * RENDER_SCALE_STEP). Frames are averaged over RENDER_WINDOW, and the average
+ * starts over after each change, so the cost of reallocating the frame does
+ * not count.
+ */
+static void adapt_render_scale(gint64 cost) {
+  static int frames = 0;
+  static gint64 cost_sum = 0;
+  if (TARGET_MS <= 0) return;
+
+  cost_sum += cost;
+  if (++frames < RENDER_WINDOW) return;
+  float mean = cost_sum / frames / (MICRO / MILLI);
+  frames = 0;
+  cost_sum = 0;
+
+  float scale = RENDER_SCALE;
+  if (mean > TARGET_MS) {
+    scale = fmaxf(RENDER_SCALE * RENDER_SCALE_STEP, MIN_RENDER_SCALE);
+  }
+  else if (mean < TARGET_MS * RENDER_HEADROOM) {
+    scale = fminf(RENDER_SCALE / RENDER_SCALE_STEP, 1.0f);
+  }
+  if (scale == RENDER_SCALE) return;
+
+  set_render_scale(scale);
+  printf("RENDER: frame %f ms for a target of %f ms, now %dx%d\n",
+    mean, TARGET_MS, frame_width(), frame_height());
+}
+
+/* Advance the simulation by one step and present it (used when the window is
+ * resized).
+ * Returns TRUE on success, FALSE on failure.
+ */
+static gboolean update_and_draw_balls(GtkWidget * widget) {
+
+  /* Update the device pixels */
+  if (step_balls()) return FALSE;
+
+  /* Get pixels back and draw image */
+  if (draw_image(widget)) return FALSE;
+
+  return TRUE;
 }
 
 /* Applies and alpha shading on the pixbuf using the device kernel ALPHA_KERNEL.
  * Updates the position of all balls using the device kernel BALLS_KERNEL.
- * Copies the pixbuf pixels back from the device and renders it.
- * This is the callback passed to `gtk_timeout_add`, and it is executed every
- * `MILLI * DELTA` milliseconds.
+ * This is one step of the simulation, of DELTA seconds.
+ * Returns 0 on success, -1 on failure.
  */
-static gboolean update_and_draw_balls(GtkWidget * widget) {
+static int step_balls(void) {
+  static int frame = 0;
 
-  /* Decrease alpha of previous frame */
-  if (alpha()) return FALSE;
+  if (device_trails_allocated) {
+    /* Lazy trails: nothing to dim, the balls are stamped with this step */
+    ++TRAIL_NOW;
+  }
+  else {
+    /* Decrease alpha of previous frame */
+    if (alpha()) return -1;
 
-  /* Wait for kernel to finish */
-  clFinish(QUEUE);
+    /* Paint the obstacles over it, if any */
+    if (draw_obstacles()) return -1;
+
+    /* Wait for kernel to finish */
+    clFinish(QUEUE);
+  }
 
   /* Update positions of all balls and set their pixels */
-  if (move_balls()) return FALSE;
+  if (move_balls()) return -1;
+  QUIET_STEPS = ACTIVE_BALLS ? 0 : QUIET_STEPS + 1;
 
   /* Wait for kernel to finish */
   clFinish(QUEUE);
 
-  /* Get pixels back and draw image */
-  if (draw_image(widget)) return FALSE;
+  /* Report the error of the compact format about once per second */
+  ++frame;
+  if (device_shadow_allocated && frame % (int)(1 / DELTA + 1) == 0) {
+    print_compact_divergence(frame);
+  }
 
-  return TRUE;
+  return 0;
 }
 
 /* Dim the pixbuf pixels using ALPHA_KERNEL.
@@ -330,97 +858,381 @@ static gboolean update_and_draw_balls(GtkWidget * widget) {
 static int alpha(void) {
   cl_int err;
 
-  int height = gdk_pixbuf_get_height(PIXBUF);
-  int row_stride = gdk_pixbuf_get_rowstride(PIXBUF);
+  int height = frame_height();
+  int row_stride = frame_row_stride();
 
   int size = (int) (height * row_stride);
 
-  err  = clSetKernelArg(ALPHA_KERNEL, 0, sizeof(cl_mem), &DEVICE_PIXELS);
-  err |= clSetKernelArg(ALPHA_KERNEL, 1, sizeof(int), &size);
-  err |= clSetKernelArg(ALPHA_KERNEL, 2, sizeof(float), &TRACE);
+  err  = util_set_kernel_arg(&ALPHA_ARGS, 0, sizeof(cl_mem), &DEVICE_PIXELS);
+  err |= util_set_kernel_arg(&ALPHA_ARGS, 1, sizeof(int), &size);
+  err |= util_set_kernel_arg(&ALPHA_ARGS, 2, sizeof(float), &TRACE);
+  /* a NULL buffer tells the kernel there are no sleeping balls */
+  err |= util_set_kernel_arg(&ALPHA_ARGS, 3, sizeof(cl_mem),
+    device_rest_allocated ? &DEVICE_REST : NULL);
 
   size_t alpha_kernel_size = (size_t) (height * row_stride);
+  cl_event event;
   err = clEnqueueNDRangeKernel(QUEUE, ALPHA_KERNEL, 1, NULL, &alpha_kernel_size,
-    NULL, 0, NULL, NULL);
+    NULL, 0, NULL, METRICS ? &event : NULL);
+
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "error launching the kernel: %s\n", util_error_message(err));
+    return -1;
+  }
+  if (METRICS) profile_stage(METRICS_STAGE_ALPHA, event);
+
+  return 0;
+}
+
+/* With lazy trails, fill the device pixels from DEVICE_COLOURS and
+ * DEVICE_STAMPS using RESOLVE_KERNEL, then paint the obstacles over them.
+ * Only done for the frames that are presented, instead of dimming the whole
+ * frame at every step.
+ * Returns 0 on success, -1 on failure.
+ */
+static int resolve_trails(void) {
+  cl_int err;
+  int w = frame_width();
+  int h = frame_height();
+  int row_stride = frame_row_stride();
+  int n_channels = frame_n_channels();
+
+  err  = clSetKernelArg(RESOLVE_KERNEL, 0, sizeof(cl_mem), &DEVICE_COLOURS);
+  err |= clSetKernelArg(RESOLVE_KERNEL, 1, sizeof(cl_mem), &DEVICE_STAMPS);
+  err |= clSetKernelArg(RESOLVE_KERNEL, 2, sizeof(cl_mem), &DEVICE_PIXELS);
+  err |= clSetKernelArg(RESOLVE_KERNEL, 3, sizeof(int), &w);
+  err |= clSetKernelArg(RESOLVE_KERNEL, 4, sizeof(int), &h);
+  err |= clSetKernelArg(RESOLVE_KERNEL, 5, sizeof(int), &row_stride);
+  err |= clSetKernelArg(RESOLVE_KERNEL, 6, sizeof(int), &n_channels);
+  err |= clSetKernelArg(RESOLVE_KERNEL, 7, sizeof(cl_uint), &TRAIL_NOW);
+  err |= clSetKernelArg(RESOLVE_KERNEL, 8, sizeof(float), &TRACE);
+  err |= clSetKernelArg(RESOLVE_KERNEL, 9, sizeof(cl_mem),
+    device_rest_allocated ? &DEVICE_REST : NULL);
+
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "resolve_trails: error setting kernel parameters: %s\n", util_error_message(err));
+    return -1;
+  }
+
+  size_t global_size[2] = { (size_t)w, (size_t)h };
+  cl_event event;
+  err = clEnqueueNDRangeKernel(QUEUE, RESOLVE_KERNEL, 2, NULL, global_size,
+    NULL, 0, NULL, METRICS ? &event : NULL);
 
   if (err != CL_SUCCESS) {
     fprintf(stderr, "error launching the kernel: %s\n", util_error_message(err));
     return -1;
   }
+  if (METRICS) profile_stage(METRICS_STAGE_RESOLVE, event);
+
+  return draw_obstacles();
+}
+
+/* List the awake balls in DEVICE_ACTIVE using ACTIVE_KERNEL, and read back
+ * how many there are in ACTIVE_BALLS, so that BALLS_KERNEL is launched on
+ * those only.
+ * Returns 0 on success, -1 on failure.
+ */
+static int list_active_balls(void) {
+  static const cl_uint zero = 0;
+  cl_uint count;
+  cl_int err;
+
+  err  = clEnqueueWriteBuffer(QUEUE, DEVICE_ACTIVE_COUNT, CL_FALSE, 0,
+    sizeof(cl_uint), &zero, 0, NULL, NULL);
+  err |= clSetKernelArg(ACTIVE_KERNEL, 0, sizeof(cl_mem), &DEVICE_SLEEP);
+  err |= clSetKernelArg(ACTIVE_KERNEL, 1, sizeof(float), &N);
+  err |= clSetKernelArg(ACTIVE_KERNEL, 2, sizeof(cl_mem), &DEVICE_ACTIVE);
+  err |= clSetKernelArg(ACTIVE_KERNEL, 3, sizeof(cl_mem), &DEVICE_ACTIVE_COUNT);
+
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "list_active_balls: error setting kernel parameters: %s\n", util_error_message(err));
+    return -1;
+  }
+
+  size_t local_size = ACTIVE_GROUP;
+  size_t global_size = ((size_t)N + ACTIVE_GROUP - 1) / ACTIVE_GROUP * ACTIVE_GROUP;
+  err  = clEnqueueNDRangeKernel(QUEUE, ACTIVE_KERNEL, 1, NULL, &global_size,
+    &local_size, 0, NULL, NULL);
+  err |= clEnqueueReadBuffer(QUEUE, DEVICE_ACTIVE_COUNT, CL_TRUE, 0,
+    sizeof(cl_uint), &count, 0, NULL, NULL);
+
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "error listing the active balls: %s\n", util_error_message(err));
+    return -1;
+  }
+  metrics_readback(sizeof(cl_uint));
+
+  ACTIVE_BALLS = (int)count;
+  return 0;
+}
+
+/* Wake all the balls up: something changed for all of them (the force, their
+ * colour, the window...). Restart the loop if it was idle.
+ */
+static void wake_balls(void) {
+  if (device_rest_allocated) {
+    clear_buffer(DEVICE_REST, sizeof(unsigned char)*frame_row_stride()*frame_height());
+  }
+  if (!device_sleep_allocated) return;
+  clear_buffer(DEVICE_SLEEP, sizeof(cl_uint)*(size_t)N);
+  ACTIVE_BALLS = (int)N;
+  QUIET_STEPS = 0;
+
+  if (IDLE_WIDGET) {
+    LAST_TICK = g_get_monotonic_time();
+    LAG = 0;
+    g_timeout_add(0, (GSourceFunc) schedule_frame, (gpointer) IDLE_WIDGET);
+    IDLE_WIDGET = NULL;
+  }
+}
+
+/* Returns 1 if all the balls are asleep and their traces have faded (so that
+ * steps would not change the frame any more), 0 otherwise.
+ */
+static int is_quiescent(void) {
+  return device_sleep_allocated && !ACTIVE_BALLS && QUIET_STEPS >= fade_steps();
+}
+
+/* Number of steps for a trace to fade from full brightness to black.
+ */
+static int fade_steps(void) {
+  if (TRACE <= 0 || TRACE >= 1) return 1;   /* no fading, or no traces */
+  return (int)ceilf(logf(0.5f / 255) / logf(sqrtf(sqrtf(1 - TRACE))));
+}
 
+/* Fill `size` bytes of `buffer` with zeros.
+ * Returns 0 on success, -1 on failure.
+ */
+static int clear_buffer(cl_mem buffer, size_t size) {
+  void * zeros = calloc(1, size);
+  if (!zeros) {
+    fprintf(stderr, "clear_buffer: out of memory\n");
+    return -1;
+  }
+  cl_int err = clEnqueueWriteBuffer(QUEUE, buffer, CL_TRUE, 0, size, zeros,
+    0, NULL, NULL);
+  free(zeros);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "error clearing a buffer: %s\n", util_error_message(err));
+    return -1;
+  }
   return 0;
 }
 
 /* Computes the new positions for all balls, with bounce and force using
- * BALLS_KERNEL.
+ * the variant of BALLS_KERNEL for the current configuration (and for the fp32
+ * shadow balls, if any, without drawing them).
  * Returns 0 on success, -1 on failure.
  */
 static int move_balls(void) {
+  if (device_sleep_allocated && list_active_balls()) return -1;
+  if (move_balls_with(balls_variant(), DEVICE_BALLS, 1)) return -1;
+  if (device_shadow_allocated) {
+    return move_balls_with(&SHADOW_ARGS, DEVICE_SHADOW_BALLS, 0);
+  }
+  return 0;
+}
+
+/* Launch the update `kernel` on `balls`, drawing them only if `draw`. Only
+ * the arguments that changed since the last launch are set again.
+ * Returns 0 on success, -1 on failure.
+ */
+static int move_balls_with(struct util_kernel_args * kernel, cl_mem balls, int draw) {
 
   cl_int err;
 
-  int width = gdk_pixbuf_get_width(PIXBUF);
-  int height = gdk_pixbuf_get_height(PIXBUF);
-  int row_stride = gdk_pixbuf_get_rowstride(PIXBUF);
-  int n_channels = gdk_pixbuf_get_n_channels(PIXBUF);
+  int width = world_width();
+  int height = world_height();
+  int row_stride = frame_row_stride();
+  int n_channels = frame_n_channels();
   unsigned int RGB = (unsigned int) R << 16 | (unsigned int) G << 8 | (unsigned int) B;
 
-  err  = clSetKernelArg(BALLS_KERNEL, 0, sizeof(cl_mem), &DEVICE_BALLS);
-  err |= clSetKernelArg(BALLS_KERNEL, 1, sizeof(float), &N);
-  err |= clSetKernelArg(BALLS_KERNEL, 2, sizeof(cl_mem), &DEVICE_PIXELS);
-  err |= clSetKernelArg(BALLS_KERNEL, 3, sizeof(int), &width);
-  err |= clSetKernelArg(BALLS_KERNEL, 4, sizeof(int), &height);
-  err |= clSetKernelArg(BALLS_KERNEL, 5, sizeof(int), &row_stride);
-  err |= clSetKernelArg(BALLS_KERNEL, 6, sizeof(int), &n_channels);
-  err |= clSetKernelArg(BALLS_KERNEL, 7, sizeof(float), &FX);
-  err |= clSetKernelArg(BALLS_KERNEL, 8, sizeof(float), &FY);
-  err |= clSetKernelArg(BALLS_KERNEL, 9, sizeof(float), &RADIUS);
-  err |= clSetKernelArg(BALLS_KERNEL, 10, sizeof(float), &DELTA);
-  err |= clSetKernelArg(BALLS_KERNEL, 11, sizeof(float), &DISSIPATION);
-  err |= clSetKernelArg(BALLS_KERNEL, 12, sizeof(unsigned int), &RGB);
+  err  = util_set_kernel_arg(kernel, 0, sizeof(cl_mem), &balls);
+  err |= util_set_kernel_arg(kernel, 1, sizeof(float), &N);
+  /* a NULL buffer tells the kernel not to draw; lazy trails are drawn at full
+   * brightness apart from the frame */
+  cl_mem * pixels = device_trails_allocated ? &DEVICE_COLOURS : &DEVICE_PIXELS;
+  err |= util_set_kernel_arg(kernel, 2, sizeof(cl_mem), draw ? pixels : NULL);
+  err |= util_set_kernel_arg(kernel, 3, sizeof(int), &width);
+  err |= util_set_kernel_arg(kernel, 4, sizeof(int), &height);
+  err |= util_set_kernel_arg(kernel, 5, sizeof(int), &row_stride);
+  err |= util_set_kernel_arg(kernel, 6, sizeof(int), &n_channels);
+  err |= util_set_kernel_arg(kernel, 7, sizeof(float), &FX);
+  err |= util_set_kernel_arg(kernel, 8, sizeof(float), &FY);
+  err |= util_set_kernel_arg(kernel, 9, sizeof(float), &RADIUS);
+  err |= util_set_kernel_arg(kernel, 10, sizeof(float), &DELTA);
+  err |= util_set_kernel_arg(kernel, 11, sizeof(float), &DISSIPATION);
+  err |= util_set_kernel_arg(kernel, 12, sizeof(unsigned int), &RGB);
+  /* a NULL buffer tells the kernel there are no obstacles */
+  err |= util_set_kernel_arg(kernel, 13, sizeof(cl_mem), device_sdf_allocated ? &DEVICE_SDF : NULL);
+  /* and here that there is no force field */
+  err |= util_set_kernel_arg(kernel, 14, sizeof(cl_mem), device_field_allocated ? &DEVICE_FIELD : NULL);
+  err |= util_set_kernel_arg(kernel, 15, sizeof(int), &device_field_cols);
+  err |= util_set_kernel_arg(kernel, 16, sizeof(int), &device_field_rows);
+  /* and here that the trails are dimmed at every step */
+  err |= util_set_kernel_arg(kernel, 17, sizeof(cl_mem),
+    draw && device_trails_allocated ? &DEVICE_STAMPS : NULL);
+  err |= util_set_kernel_arg(kernel, 18, sizeof(cl_uint), &TRAIL_NOW);
+  float scale = RENDER_SCALE * ZOOM;
+  err |= util_set_kernel_arg(kernel, 19, sizeof(float), &scale);
+  /* and here that all balls are awake, and never sleep */
+  int sleeping = draw && device_sleep_allocated;
+  err |= util_set_kernel_arg(kernel, 20, sizeof(cl_mem), sleeping ? &DEVICE_ACTIVE : NULL);
+  err |= util_set_kernel_arg(kernel, 21, sizeof(cl_mem), sleeping ? &DEVICE_SLEEP : NULL);
+  err |= util_set_kernel_arg(kernel, 22, sizeof(cl_mem),
+    sleeping && device_rest_allocated ? &DEVICE_REST : NULL);
+  err |= util_set_kernel_arg(kernel, 23, sizeof(float), &SLEEP_SPEED);
+  /* the balls outside the view are not drawn */
+  int frame_w = frame_width();
+  int frame_h = frame_height();
+  err |= util_set_kernel_arg(kernel, 24, sizeof(float), &VIEW_X);
+  err |= util_set_kernel_arg(kernel, 25, sizeof(float), &VIEW_Y);
+  err |= util_set_kernel_arg(kernel, 26, sizeof(int), &frame_w);
+  err |= util_set_kernel_arg(kernel, 27, sizeof(int), &frame_h);
 
   if (err != CL_SUCCESS) {
     fprintf(stderr, "move_balls: error setting kernel parameters: %s\n", util_error_message(err));
     return -1;
   }
 
-  size_t balls_kernel_size = (size_t)N;
-  err = clEnqueueNDRangeKernel(QUEUE, BALLS_KERNEL, 1, NULL, &balls_kernel_size,
-    NULL, 0, NULL, NULL);
+  /* only the awake balls, if some may sleep */
+  size_t balls_kernel_size = sleeping ? (size_t)ACTIVE_BALLS : (size_t)N;
+  if (!balls_kernel_size) return 0;
+  /* the shadow balls are profiled with the drawn ones */
+  cl_event event;
+  err = clEnqueueNDRangeKernel(QUEUE, kernel->kernel, 1, NULL, &balls_kernel_size,
+    NULL, 0, NULL, METRICS ? &event : NULL);
 
   if (err != CL_SUCCESS) {
     fprintf(stderr, "error launching the kernel: %s\n", util_error_message(err));
     return -1;
   }
+  if (METRICS) profile_stage(METRICS_STAGE_UPDATE, event);
 
   return 0;
 }
 
-/* Reads the device pixels back into the host's pixbuf, then draws the pixbuf
- * using Gtk.
+/* The update kernel built for the current configuration: pixel format,
+ * radius, dissipation, obstacles and force field are compile-time constants
+ * (see SPECIALISE in the kernel). A variant is compiled the first time its
+ * configuration is seen, then kept in BALLS_VARIANTS. If it does not compile,
+ * or there are too many, the generic BALLS_KERNEL is used instead.
+ */
+static struct util_kernel_args * balls_variant(void) {
+  char options[MAX_OPTIONS];
+  snprintf(options, sizeof(options), "%s -D SPEC_N_CHANNELS=%d -D SPEC_RADIUS=%.9g%s%s%s",
+    KERNEL_CONSTANTS, frame_n_channels(), RADIUS,
+    DISSIPATION == 0.0f ? " -D SPEC_NO_HEAT" : "",
+    device_sdf_allocated ? "" : " -D SPEC_NO_SDF",
+    device_field_allocated ? "" : " -D SPEC_NO_FIELD");
+
+  for (int i = 0; i < balls_variants_count; ++i) {
+    if (!strcmp(BALLS_VARIANTS[i].options, options)) {
+      return BALLS_VARIANTS[i].available ? &BALLS_VARIANTS[i].args : &BALLS_ARGS;
+    }
+  }
+  if (balls_variants_count == MAX_BALLS_VARIANTS) return &BALLS_ARGS;
+
+  struct balls_variant * variant = &BALLS_VARIANTS[balls_variants_count++];
+  cl_kernel kernel;
+  strcpy(variant->options, options);
+  variant->available = util_compile_kernel_with_options(kernel_sources,
+    sizeof(kernel_sources)/sizeof(const char *),
+    COMPACT ? update_balls_compact_kernel : update_balls_kernel, options,
+    DEVICE, CONTEXT, &kernel) == 0;
+  if (!variant->available) {
+    fprintf(stderr, "using the generic update kernel for %s\n", options);
+    return &BALLS_ARGS;
+  }
+  util_reset_kernel_args(&variant->args, kernel);
+  return &variant->args;
+}
+
+/* Compares the compact balls with the fp32 shadow balls using
+ * DIVERGENCE_KERNEL and prints the mean and max distance between the two.
+ */
+static void print_compact_divergence(int frame) {
+  cl_int err;
+
+  int width = world_width();
+  int height = world_height();
+
+  err  = clSetKernelArg(DIVERGENCE_KERNEL, 0, sizeof(cl_mem), &DEVICE_BALLS);
+  err |= clSetKernelArg(DIVERGENCE_KERNEL, 1, sizeof(cl_mem), &DEVICE_SHADOW_BALLS);
+  err |= clSetKernelArg(DIVERGENCE_KERNEL, 2, sizeof(float), &N);
+  err |= clSetKernelArg(DIVERGENCE_KERNEL, 3, sizeof(int), &width);
+  err |= clSetKernelArg(DIVERGENCE_KERNEL, 4, sizeof(int), &height);
+  err |= clSetKernelArg(DIVERGENCE_KERNEL, 5, sizeof(cl_mem), &DEVICE_DISTANCES);
+
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "print_compact_divergence: error setting kernel parameters: %s\n", util_error_message(err));
+    return;
+  }
+
+  size_t divergence_kernel_size = (size_t)N;
+  err = clEnqueueNDRangeKernel(QUEUE, DIVERGENCE_KERNEL, 1, NULL,
+    &divergence_kernel_size, NULL, 0, NULL, NULL);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "error launching the kernel: %s\n", util_error_message(err));
+    return;
+  }
+
+  float * distances = malloc((size_t)N * sizeof(float));
+  if (!distances) return;
+  err = clEnqueueReadBuffer(QUEUE, DEVICE_DISTANCES, CL_TRUE,
+    0, sizeof(float) * (size_t)N,
+    distances,
+    0, NULL, NULL);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "error reading distances from GPU: %s\n", util_error_message(err));
+    free(distances);
+    return;
+  }
+
+  double sum = 0;
+  float max = 0;
+  for (size_t i = 0; i < (size_t)N; ++i) {
+    sum += distances[i];
+    if (distances[i] > max) max = distances[i];
+  }
+  printf("COMPACT: frame %d, divergence from fp32 mean %f px, max %f px\n",
+    frame, sum / (size_t)N, max);
+  free(distances);
+}
+
+/* Reads the device pixels back into the host's frame, then presents the frame.
  * Returns 0 on success, -1 on failure.
  */
 int draw_image(GtkWidget *widget) {
-  int w = gdk_pixbuf_get_width(PIXBUF);
-  int h = gdk_pixbuf_get_height(PIXBUF);
-  int row_stride = gdk_pixbuf_get_rowstride(PIXBUF);
-  guchar * pixels = gdk_pixbuf_get_pixels(PIXBUF);
+  int h = frame_height();
+  int row_stride = frame_row_stride();
+  unsigned char * pixels = frame_pixels();
   cl_int err;
 
-  /* Get the pixbuf back */
+  #if PRESENT_WITH_CAIRO
+  /* cairo may still hold pending drawing on the surface */
+  cairo_surface_flush(SURFACE);
+  #endif
+
+  /* Fade the lazy trails to this step */
+  if (device_trails_allocated && resolve_trails()) return -1;
+
+  /* Get the frame back */
+  cl_event event;
   err = clEnqueueReadBuffer(QUEUE, DEVICE_PIXELS, CL_TRUE,
 		0, sizeof(unsigned char)*h*row_stride,
     pixels,
-    0, NULL, NULL);
+    0, NULL, METRICS ? &event : NULL);
   if (err != CL_SUCCESS) {
     fprintf(stderr, "error reading pixbuf from GPU: %s\n", util_error_message(err));
     return -1;
   }
+  if (METRICS) profile_stage(METRICS_STAGE_READBACK, event);
+  metrics_readback(sizeof(unsigned char)*h*row_stride);
 
   /* Draw */
-  gdk_draw_pixbuf(widget->window, NULL, PIXBUF,
-    0, 0, 0, 0, w, h,
-    GDK_RGB_DITHER_NONE, 0, 0);
+  present_frame(widget);
   return 0;
 }
 
@@ -430,64 +1242,796 @@ int draw_image(GtkWidget *widget) {
 
 
 /* #############################################################################
- * #                                  CONTROLS                                 #
+ * #                               FORCE FIELDS                                #
  */
 
-/* Stops the execution of the app
- */
-static void destroy_window(void) {
-  gtk_main_quit();
-}
-
-/* Reads keyboard input and acts accordingly
+/* Switch the force field to `source` (one of the FIELD_* constants). The new
+ * field is written (or computed) by commands enqueued after the ones of the
+ * current frame, so it can be swapped at any time without waiting for the
+ * device, and without rebuilding any kernel.
+ * Returns 0 on success, -1 on failure (then the field is unchanged).
  */
-static gint keyboard_input(GtkWidget *widget, GdkEventKey *event) {
-  if (event->type != GDK_KEY_PRESS) return FALSE;
-
-  switch(event->keyval) {
-    case GDK_KEY_Up:
-    FY -= FORCE;
-    printf("FY: %f\n", FY);
+static int set_field(int source) {
+  int err = 0;
+
+  switch (source) {
+    case FIELD_NONE:
+    /* the buffer is freed when the kernels still using it are done */
+    if (device_field_allocated) {
+      clReleaseMemObject(DEVICE_FIELD);
+      device_field_allocated = 0;
+    }
     break;
 
-    case GDK_KEY_Down:
-    FY += FORCE;
-    printf("FY: %f\n", FY);
+    case FIELD_FILE:
+    err = load_field_file();
     break;
 
-    case GDK_KEY_Left:
-    FX -= FORCE;
-    printf("FX: %f\n", FX);
+    case FIELD_VORTEX:
+    case FIELD_SINK:
+    err = compute_analytic_field(source);
     break;
+  }
 
-    case GDK_KEY_Right:
-    FX += FORCE;
-    printf("FX: %f\n", FX);
-    break;
+  if (err) return -1;
+  FIELD_SOURCE = source;
+  return 0;
+}
 
-    case GDK_KEY_a:
-    TRACE -= PRECISION;
-    printf("TRACE: %f\n", TRACE);
-    break;
+/* Returns 1 if the `field=` argument is a file name, 0 otherwise.
+ */
+static int field_is_file(void) {
+  return FIELD && strcmp(FIELD, "vortex") && strcmp(FIELD, "sink");
+}
 
-    case GDK_KEY_d:
-    TRACE += PRECISION;
-    printf("TRACE: %f\n", TRACE);
-    break;
+/* Make sure DEVICE_FIELD is a grid of `cols` x `rows`.
+ * Returns 0 on success, -1 on failure.
+ */
+static int allocate_device_field(int cols, int rows) {
+  if (device_field_allocated && device_field_cols == cols
+      && device_field_rows == rows) {
+    return 0;
+  }
 
-    /* BREAKS IN SOME CASES: when a ball is on the edge and the radius is
-     * increased, the ball gets clipped and it could cause an error */
-    // case GDK_KEY_w:
-    // RADIUS = (float)((int)(RADIUS + 1) % 400);
-    // printf("RADIUS: %f\n", RADIUS);
-    // break;
-    //
-    // case GDK_KEY_s:
-    // RADIUS -= 1;
-    // printf("RADIUS: %f\n", RADIUS);
-    // break;
+  cl_int err;
+  cl_mem field = clCreateBuffer(CONTEXT, CL_MEM_READ_ONLY,
+    sizeof(float) * 2 * cols * rows, NULL, &err);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "failed to create force field buffer on device\n%s\n",
+      util_error_message(err));
+    return -1;
+  }
+  if (device_field_allocated) clReleaseMemObject(DEVICE_FIELD);
+  DEVICE_FIELD = field;
+  device_field_cols = cols;
+  device_field_rows = rows;
+  device_field_allocated = 1;
+  forget_kernel_args();
+  return 0;
+}
 
-    case GDK_KEY_r:
+/* Read the force field from the file given as `field=`. The file is text:
+ *   FIELD cols rows
+ * followed by cols x rows pairs `fx fy` (in pixels/s^2), one row after the
+ * other from the top left. The grid is stretched over the world and
+ * interpolated bilinearly between the centres of the cells.
+ * Returns 0 on success, -1 on failure.
+ */
+static int load_field_file(void) {
+  if (!FIELD) return -1;
+
+  FILE * f = fopen(FIELD, "r");
+  if (!f) {
+    fprintf(stderr, "could not open force field file %s\n", FIELD);
+    return -1;
+  }
+
+  int cols, rows;
+  if (fscanf(f, " FIELD %d %d", &cols, &rows) != 2 || cols <= 0 || rows <= 0) {
+    fprintf(stderr, "%s is not a force field file\n", FIELD);
+    fclose(f);
+    return -1;
+  }
+
+  float * field = malloc(sizeof(float) * 2 * cols * rows);
+  if (!field) {
+    fprintf(stderr, "could not allocate memory for force field %s\n", FIELD);
+    fclose(f);
+    return -1;
+  }
+  for (size_t i = 0; i < (size_t)2 * cols * rows; ++i) {
+    if (fscanf(f, "%f", &field[i]) != 1) {
+      fprintf(stderr, "force field file %s is too short\n", FIELD);
+      free(field);
+      fclose(f);
+      return -1;
+    }
+  }
+  fclose(f);
+
+  if (allocate_device_field(cols, rows)) {
+    free(field);
+    return -1;
+  }
+
+  /* The previous host copy can go once its write is done (it is, frames wait
+   * for the device) */
+  if (FIELD_WRITTEN) {
+    clWaitForEvents(1, &FIELD_WRITTEN);
+    clReleaseEvent(FIELD_WRITTEN);
+    free(FIELD_HOST);
+    FIELD_WRITTEN = NULL;
+  }
+
+  /* Do not wait for the write: the queue orders it before the next update */
+  cl_int err = clEnqueueWriteBuffer(QUEUE, DEVICE_FIELD, CL_FALSE,
+    0, sizeof(float) * 2 * cols * rows, field, 0, NULL, &FIELD_WRITTEN);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "error writing force field to GPU: %s\n", util_error_message(err));
+    free(field);
+    FIELD_WRITTEN = NULL;
+    return -1;
+  }
+  FIELD_HOST = field;
+  printf("FIELD: %s (%dx%d)\n", FIELD, cols, rows);
+  return 0;
+}
+
+/* Compute an analytic force field (FIELD_VORTEX or FIELD_SINK) on the device
+ * using FIELD_KERNEL.
+ * Returns 0 on success, -1 on failure.
+ */
+static int compute_analytic_field(int type) {
+  if (allocate_device_field(FIELD_GRID, FIELD_GRID)) return -1;
+
+  cl_int err;
+  float strength = FIELD_STRENGTH;
+
+  err  = clSetKernelArg(FIELD_KERNEL, 0, sizeof(cl_mem), &DEVICE_FIELD);
+  err |= clSetKernelArg(FIELD_KERNEL, 1, sizeof(int), &device_field_cols);
+  err |= clSetKernelArg(FIELD_KERNEL, 2, sizeof(int), &device_field_rows);
+  err |= clSetKernelArg(FIELD_KERNEL, 3, sizeof(int), &type);
+  err |= clSetKernelArg(FIELD_KERNEL, 4, sizeof(float), &strength);
+
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "compute_analytic_field: error setting kernel parameters: %s\n", util_error_message(err));
+    return -1;
+  }
+
+  size_t global_size[2] = { (size_t)device_field_cols, (size_t)device_field_rows };
+  err = clEnqueueNDRangeKernel(QUEUE, FIELD_KERNEL, 2, NULL, global_size,
+    NULL, 0, NULL, NULL);
+
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "error launching the kernel: %s\n", util_error_message(err));
+    return -1;
+  }
+  printf("FIELD: %s\n", type == FIELD_VORTEX ? "vortex" : "sink");
+  return 0;
+}
+
+
+
+
+
+
+/* #############################################################################
+ * #                                 ENSEMBLE                                  #
+ */
+
+/* Run the ensemble of the file given as `sweep=`: M simulations of `n` balls
+ * in one buffer, all stepped by a single launch of a 2D kernel (balls x
+ * members) for `steps` steps of `delta`, in the default window size. Then
+ * print the statistics of each member as CSV on stdout, and the throughput on
+ * stderr.
+ * Members all start from the same initial distribution (`init`, `seed`), and
+ * do not use compact, obstacles or force fields.
+ * Returns 0 on success, -1 on failure.
+ */
+static int run_ensemble(void) {
+  if (!opencl_framework_available) {
+    fprintf(stderr, "run_ensemble: OpenCL is unavailable\n");
+    return -1;
+  }
+
+  int members;
+  float * params = read_sweep(&members);
+  if (!params) return -1;
+
+  int ret = -1;
+  cl_int err;
+  cl_kernel init_kernel, update_kernel, stats_kernel;
+  cl_mem balls, device_params, stats;
+  float * host_stats = NULL;
+
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      ensemble_init_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &init_kernel) != 0) {
+    goto init_kernel_unavailable;
+  }
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      ensemble_update_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &update_kernel) != 0) {
+    goto update_kernel_unavailable;
+  }
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      ensemble_stats_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &stats_kernel) != 0) {
+    goto stats_kernel_unavailable;
+  }
+
+  balls = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
+    sizeof(float) * 4 * (size_t)N * members, NULL, &err);
+  if (err != CL_SUCCESS) goto balls_unavailable;
+  device_params = clCreateBuffer(CONTEXT, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    sizeof(cl_float4) * members, params, &err);
+  if (err != CL_SUCCESS) goto params_unavailable;
+  stats = clCreateBuffer(CONTEXT, CL_MEM_WRITE_ONLY,
+    sizeof(cl_float4) * members, NULL, &err);
+  if (err != CL_SUCCESS) goto stats_unavailable;
+
+  int width = DEFAULT_WIDTH;
+  int height = DEFAULT_HEIGHT;
+  cl_uint seed = (cl_uint) SEED;
+  int distribution = (int) DISTRIBUTION;
+  size_t global_size[2] = { (size_t)N, (size_t)members };
+
+  err  = clSetKernelArg(init_kernel, 0, sizeof(cl_mem), &balls);
+  err |= clSetKernelArg(init_kernel, 1, sizeof(float), &N);
+  err |= clSetKernelArg(init_kernel, 2, sizeof(cl_mem), &device_params);
+  err |= clSetKernelArg(init_kernel, 3, sizeof(int), &width);
+  err |= clSetKernelArg(init_kernel, 4, sizeof(int), &height);
+  err |= clSetKernelArg(init_kernel, 5, sizeof(float), &RADIUS);
+  err |= clSetKernelArg(init_kernel, 6, sizeof(cl_uint), &seed);
+  err |= clSetKernelArg(init_kernel, 7, sizeof(int), &distribution);
+  err |= clEnqueueNDRangeKernel(QUEUE, init_kernel, 2, NULL, global_size,
+    NULL, 0, NULL, NULL);
+  if (err != CL_SUCCESS) goto kernel_failed;
+  clFinish(QUEUE);
+
+  /* The arguments do not change between steps: set them once */
+  err  = clSetKernelArg(update_kernel, 0, sizeof(cl_mem), &balls);
+  err |= clSetKernelArg(update_kernel, 1, sizeof(float), &N);
+  err |= clSetKernelArg(update_kernel, 2, sizeof(cl_mem), &device_params);
+  err |= clSetKernelArg(update_kernel, 3, sizeof(int), &width);
+  err |= clSetKernelArg(update_kernel, 4, sizeof(int), &height);
+  err |= clSetKernelArg(update_kernel, 5, sizeof(float), &RADIUS);
+  err |= clSetKernelArg(update_kernel, 6, sizeof(float), &DELTA);
+  if (err != CL_SUCCESS) goto kernel_failed;
+
+  gint64 start = g_get_monotonic_time();
+  for (int step = 0; step < (int)STEPS; ++step) {
+    err = clEnqueueNDRangeKernel(QUEUE, update_kernel, 2, NULL, global_size,
+      NULL, 0, NULL, NULL);
+    if (err != CL_SUCCESS) goto kernel_failed;
+  }
+  clFinish(QUEUE);
+  gint64 elapsed = g_get_monotonic_time() - start;
+
+  size_t stats_size = (size_t)members * ENSEMBLE_GROUP;
+  size_t group_size = ENSEMBLE_GROUP;
+  err  = clSetKernelArg(stats_kernel, 0, sizeof(cl_mem), &balls);
+  err |= clSetKernelArg(stats_kernel, 1, sizeof(float), &N);
+  err |= clSetKernelArg(stats_kernel, 2, sizeof(cl_mem), &stats);
+  err |= clEnqueueNDRangeKernel(QUEUE, stats_kernel, 1, NULL, &stats_size,
+    &group_size, 0, NULL, NULL);
+  if (err != CL_SUCCESS) goto kernel_failed;
+
+  host_stats = malloc(sizeof(cl_float4) * members);
+  if (!host_stats) {
+    fprintf(stderr, "run_ensemble: out of memory for the statistics\n");
+    goto kernel_failed;
+  }
+  err = clEnqueueReadBuffer(QUEUE, stats, CL_TRUE,
+    0, sizeof(cl_float4) * members, host_stats, 0, NULL, NULL);
+  if (err != CL_SUCCESS) goto kernel_failed;
+
+  printf("member,fx,fy,dissipation,speed,mean_x,mean_y,mean_speed,mean_energy\n");
+  for (int m = 0; m < members; ++m) {
+    float * p = params + m * 4;
+    float * st = host_stats + m * 4;
+    printf("%d,%f,%f,%f,%f,%f,%f,%f,%f\n", m, p[0], p[1], p[2], p[3],
+      st[0], st[1], st[2], st[3]);
+  }
+  fprintf(stderr, "ENSEMBLE: %d members x %d balls x %d steps in %f s "
+    "(%f Mballs steps/s)\n", members, (int)N, (int)STEPS, elapsed / 1e6,
+    (double)members * (int)N * (int)STEPS / (elapsed > 0 ? elapsed : 1));
+  ret = 0;
+
+  kernel_failed:
+    if (ret && err != CL_SUCCESS) {
+      fprintf(stderr, "error running the ensemble: %s\n", util_error_message(err));
+      err = CL_SUCCESS;
+    }
+    free(host_stats);
+    clReleaseMemObject(stats);
+  stats_unavailable:
+    clReleaseMemObject(device_params);
+  params_unavailable:
+    clReleaseMemObject(balls);
+  balls_unavailable:
+    if (err != CL_SUCCESS) {
+      fprintf(stderr, "failed to create ensemble buffers on device\n%s\n",
+        util_error_message(err));
+    }
+    clReleaseKernel(stats_kernel);
+  stats_kernel_unavailable:
+    clReleaseKernel(update_kernel);
+  update_kernel_unavailable:
+    clReleaseKernel(init_kernel);
+  init_kernel_unavailable:
+    free(params);
+    shutdown_opencl_framework();
+    return ret;
+}
+
+/* Read the parameter sweep file given as `sweep=`: one member per line, as
+ *   fx fy dissipation speed
+ * Empty lines and lines starting with # are skipped.
+ * Returns the parameters (4 floats per member, to free) and stores their
+ * number in `members`, or returns NULL on failure.
+ */
+static float * read_sweep(int * members) {
+  FILE * f = fopen(SWEEP, "r");
+  if (!f) {
+    fprintf(stderr, "could not open sweep file %s\n", SWEEP);
+    return NULL;
+  }
+
+  int capacity = 16;
+  float * params = malloc(sizeof(float) * 4 * capacity);
+  char line[256];
+  *members = 0;
+  while (params && fgets(line, sizeof(line), f)) {
+    float * p;
+    char * c = line;
+    while (*c == ' ' || *c == '\t') ++c;
+    if (*c == '#' || *c == '\n' || *c == '\0') continue;
+
+    if (*members == capacity) {
+      capacity *= 2;
+      float * more = realloc(params, sizeof(float) * 4 * capacity);
+      if (!more) {
+        free(params);
+        params = NULL;
+        break;
+      }
+      params = more;
+    }
+    p = params + *members * 4;
+    if (sscanf(c, "%f %f %f %f", p, p + 1, p + 2, p + 3) != 4) {
+      fprintf(stderr, "%s: bad line `%s'\n", SWEEP, line);
+      free(params);
+      fclose(f);
+      return NULL;
+    }
+    ++*members;
+  }
+  fclose(f);
+
+  if (!params) {
+    fprintf(stderr, "could not allocate memory for sweep %s\n", SWEEP);
+    return NULL;
+  }
+  if (*members == 0) {
+    fprintf(stderr, "%s: no members\n", SWEEP);
+    free(params);
+    return NULL;
+  }
+  return params;
+}
+
+
+
+
+
+
+/* #############################################################################
+ * #                                 OBSTACLES                                 #
+ */
+
+/* Load the obstacles mask from the file given as `obstacles=` (if any), and
+ * compute its distance field for the current frame.
+ * Returns 0 on success (or if there are no obstacles), -1 on failure.
+ */
+static int load_obstacles(void) {
+  if (!OBSTACLES) return 0;
+
+  GError * error = NULL;
+  OBSTACLES_MASK = gdk_pixbuf_new_from_file(OBSTACLES, &error);
+  if (!OBSTACLES_MASK) {
+    fprintf(stderr, "failed to load obstacles from %s: %s\n", OBSTACLES,
+      error ? error->message : "unknown error");
+    if (error) g_error_free(error);
+    return -1;
+  }
+  return compute_sdf();
+}
+
+/* Stretch the obstacles mask to the world and compute its signed distance
+ * field on the device with jump flooding (see particles_kernel.cl). This only
+ * happens when the obstacles are loaded and when the world is resized, so the
+ * temporary buffers (mask and seeds) are released right away.
+ * Returns 0 on success (or if there are no obstacles), -1 on failure.
+ */
+static int compute_sdf(void) {
+  if (!OBSTACLES_MASK || !obstacle_kernels_available) return 0;
+
+  cl_int err;
+  int w = world_width();
+  int h = world_height();
+
+  if (device_sdf_allocated) {
+    clReleaseMemObject(DEVICE_SDF);
+    device_sdf_allocated = 0;
+  }
+
+  /* Stretch the mask to the world, one byte per pixel */
+  GdkPixbuf * scaled = gdk_pixbuf_scale_simple(OBSTACLES_MASK, w, h,
+    GDK_INTERP_NEAREST);
+  unsigned char * mask = malloc((size_t)w * h);
+  if (!scaled || !mask) {
+    fprintf(stderr, "compute_sdf: failed to allocate the mask\n");
+    if (scaled) g_object_unref(scaled);
+    free(mask);
+    return -1;
+  }
+  int row_stride = gdk_pixbuf_get_rowstride(scaled);
+  int n_channels = gdk_pixbuf_get_n_channels(scaled);
+  int has_alpha = gdk_pixbuf_get_has_alpha(scaled);
+  guchar * pixels = gdk_pixbuf_get_pixels(scaled);
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      guchar * pixel = pixels + y * row_stride + x * n_channels;
+      int brightness = (pixel[0] + pixel[1] + pixel[2]) / 3;
+      if (has_alpha && pixel[3] <= OBSTACLES_THRESHOLD) brightness = 0;
+      mask[y * w + x] = brightness > OBSTACLES_THRESHOLD;
+    }
+  }
+  g_object_unref(scaled);
+
+  /* Device buffers: mask, two seeds buffers to ping-pong, distance field */
+  cl_mem device_mask = clCreateBuffer(CONTEXT,
+    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, (size_t)w * h, mask, &err);
+  free(mask);
+  if (err != CL_SUCCESS) goto mask_unavailable;
+  cl_mem seeds[2];
+  seeds[0] = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
+    sizeof(cl_int) * 4 * w * h, NULL, &err);
+  if (err != CL_SUCCESS) goto seeds_unavailable;
+  seeds[1] = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
+    sizeof(cl_int) * 4 * w * h, NULL, &err);
+  if (err != CL_SUCCESS) goto more_seeds_unavailable;
+  DEVICE_SDF = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
+    sizeof(float) * w * h, NULL, &err);
+  if (err != CL_SUCCESS) goto sdf_unavailable;
+
+  size_t global_size[2] = { (size_t)w, (size_t)h };
+
+  /* Seeds from the mask */
+  err  = clSetKernelArg(JFA_INIT_KERNEL, 0, sizeof(cl_mem), &device_mask);
+  err |= clSetKernelArg(JFA_INIT_KERNEL, 1, sizeof(int), &w);
+  err |= clSetKernelArg(JFA_INIT_KERNEL, 2, sizeof(int), &h);
+  err |= clSetKernelArg(JFA_INIT_KERNEL, 3, sizeof(cl_mem), &seeds[0]);
+  err |= clEnqueueNDRangeKernel(QUEUE, JFA_INIT_KERNEL, 2, NULL, global_size,
+    NULL, 0, NULL, NULL);
+  if (err != CL_SUCCESS) goto kernel_failed;
+
+  /* Jump flooding: steps of size/2, size/4, ..., 1, and 1 again */
+  int max_step = 1;
+  int passes = 2;
+  while (max_step * 2 < (w > h ? w : h)) {
+    max_step *= 2;
+    ++passes;
+  }
+  int current = 0;
+  for (int pass = 0; pass < passes; ++pass) {
+    int step = (pass < passes - 1) ? max_step >> pass : 1;
+    err  = clSetKernelArg(JFA_STEP_KERNEL, 0, sizeof(cl_mem), &seeds[current]);
+    err |= clSetKernelArg(JFA_STEP_KERNEL, 1, sizeof(cl_mem), &seeds[1 - current]);
+    err |= clSetKernelArg(JFA_STEP_KERNEL, 2, sizeof(int), &w);
+    err |= clSetKernelArg(JFA_STEP_KERNEL, 3, sizeof(int), &h);
+    err |= clSetKernelArg(JFA_STEP_KERNEL, 4, sizeof(int), &step);
+    err |= clEnqueueNDRangeKernel(QUEUE, JFA_STEP_KERNEL, 2, NULL, global_size,
+      NULL, 0, NULL, NULL);
+    if (err != CL_SUCCESS) goto kernel_failed;
+    current = 1 - current;
+  }
+
+  /* Seeds to distances */
+  err  = clSetKernelArg(JFA_DISTANCE_KERNEL, 0, sizeof(cl_mem), &device_mask);
+  err |= clSetKernelArg(JFA_DISTANCE_KERNEL, 1, sizeof(cl_mem), &seeds[current]);
+  err |= clSetKernelArg(JFA_DISTANCE_KERNEL, 2, sizeof(int), &w);
+  err |= clSetKernelArg(JFA_DISTANCE_KERNEL, 3, sizeof(int), &h);
+  err |= clSetKernelArg(JFA_DISTANCE_KERNEL, 4, sizeof(cl_mem), &DEVICE_SDF);
+  err |= clEnqueueNDRangeKernel(QUEUE, JFA_DISTANCE_KERNEL, 2, NULL, global_size,
+    NULL, 0, NULL, NULL);
+  if (err != CL_SUCCESS) goto kernel_failed;
+
+  /* Wait for kernels to finish */
+  clFinish(QUEUE);
+
+  clReleaseMemObject(seeds[1]);
+  clReleaseMemObject(seeds[0]);
+  clReleaseMemObject(device_mask);
+  device_sdf_allocated = 1;
+  forget_kernel_args();
+  return 0;
+
+  kernel_failed:
+    fprintf(stderr, "error launching the distance field kernels: %s\n",
+      util_error_message(err));
+    clFinish(QUEUE);
+    clReleaseMemObject(DEVICE_SDF);
+    err = CL_SUCCESS;
+  sdf_unavailable:
+    clReleaseMemObject(seeds[1]);
+  more_seeds_unavailable:
+    clReleaseMemObject(seeds[0]);
+  seeds_unavailable:
+    clReleaseMemObject(device_mask);
+  mask_unavailable:
+    if (err != CL_SUCCESS) {
+      fprintf(stderr, "failed to create distance field buffers on device\n%s\n",
+        util_error_message(err));
+    }
+    return -1;
+}
+
+/* Paint the obstacles on the device pixels using OBSTACLES_KERNEL.
+ * Returns 0 on success (or if there are no obstacles), -1 on failure.
+ */
+static int draw_obstacles(void) {
+  if (!device_sdf_allocated) return 0;
+
+  cl_int err;
+  int w = world_width();
+  int h = world_height();
+  int row_stride = frame_row_stride();
+  int n_channels = frame_n_channels();
+  unsigned int RGB = OBSTACLES_RGB;
+  float scale = RENDER_SCALE * ZOOM;
+
+  err  = clSetKernelArg(OBSTACLES_KERNEL, 0, sizeof(cl_mem), &DEVICE_SDF);
+  err |= clSetKernelArg(OBSTACLES_KERNEL, 1, sizeof(int), &w);
+  err |= clSetKernelArg(OBSTACLES_KERNEL, 2, sizeof(int), &h);
+  err |= clSetKernelArg(OBSTACLES_KERNEL, 3, sizeof(cl_mem), &DEVICE_PIXELS);
+  err |= clSetKernelArg(OBSTACLES_KERNEL, 4, sizeof(int), &row_stride);
+  err |= clSetKernelArg(OBSTACLES_KERNEL, 5, sizeof(int), &n_channels);
+  err |= clSetKernelArg(OBSTACLES_KERNEL, 6, sizeof(unsigned int), &RGB);
+  err |= clSetKernelArg(OBSTACLES_KERNEL, 7, sizeof(float), &scale);
+  err |= clSetKernelArg(OBSTACLES_KERNEL, 8, sizeof(float), &VIEW_X);
+  err |= clSetKernelArg(OBSTACLES_KERNEL, 9, sizeof(float), &VIEW_Y);
+
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "draw_obstacles: error setting kernel parameters: %s\n", util_error_message(err));
+    return -1;
+  }
+
+  /* over the frame */
+  size_t global_size[2] = { (size_t)frame_width(), (size_t)frame_height() };
+  err = clEnqueueNDRangeKernel(QUEUE, OBSTACLES_KERNEL, 2, NULL, global_size,
+    NULL, 0, NULL, NULL);
+
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "error launching the kernel: %s\n", util_error_message(err));
+    return -1;
+  }
+
+  return 0;
+}
+
+
+
+
+
+
+/* #############################################################################
+ * #                               PARTICLE FILES                              #
+ */
+
+/* Map the file given as `load=` and check its header:
+ *   magic    uint32  PARTICLES_MAGIC
+ *   version  uint32  PARTICLES_VERSION
+ *   count    uint64  the number of balls
+ * followed by `count` balls as (x, y, vx, vy) floats, in world pixels and
+ * pixels/s, all native-endian. Sets N to the number of balls (rounded down
+ * to a float). The file stays mapped until load_balls.
+ * Returns 0 on success, -1 on failure.
+ */
+static int map_particles_file(void) {
+  int fd = open(LOAD, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "could not open particles file %s\n", LOAD);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct particles_header)) {
+    fprintf(stderr, "%s is not a particles file\n", LOAD);
+    close(fd);
+    return -1;
+  }
+  void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "could not map particles file %s\n", LOAD);
+    return -1;
+  }
+
+  const struct particles_header * header = map;
+  uint64_t room = (st.st_size - sizeof(struct particles_header)) / (4 * sizeof(float));
+  if (header->magic != PARTICLES_MAGIC || header->version != PARTICLES_VERSION
+      || header->count == 0 || header->count > room) {
+    fprintf(stderr, "%s: wrong header or truncated file\n", LOAD);
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  /* the file is read once, from start to end */
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  N = (float)header->count;
+  if ((uint64_t)N > header->count) N = nextafterf(N, 0);
+  LOAD_MAP = map;
+  LOAD_SIZE = st.st_size;
+  return 0;
+}
+
+/* Upload the balls of the mapped particle file to DEVICE_BALLS (and to the
+ * fp32 shadow balls, if any), LOAD_CHUNK bytes at a time. The writes are not
+ * blocking and read straight from the mapping: while a chunk is transferred,
+ * the next one is read ahead from the disk (see advise_chunk). Compact balls
+ * go through a staging buffer of one chunk and are packed by PACK_KERNEL.
+ * Unmaps the file.
+ * Returns 0 on success, -1 on failure.
+ */
+static int load_balls(void) {
+  const char * balls = (const char *)LOAD_MAP + sizeof(struct particles_header);
+  size_t ball_bytes = 4 * sizeof(float);
+  size_t n_balls = (size_t)N;
+  size_t chunk = LOAD_CHUNK / ball_bytes;
+  cl_mem staging = NULL;
+  cl_int err = CL_SUCCESS;
+  int width = world_width();
+  int height = world_height();
+
+  if (COMPACT) {
+    if (!pack_kernel_available) {
+      fprintf(stderr, "loading compact balls unavailable\n");
+      goto unmap;
+    }
+    staging = clCreateBuffer(CONTEXT, CL_MEM_READ_ONLY, chunk * ball_bytes, NULL, &err);
+    if (err != CL_SUCCESS) goto failed;
+  }
+
+  advise_chunk(balls, balls + (chunk < n_balls ? chunk : n_balls) * ball_bytes);
+  for (size_t first = 0; first < n_balls; first += chunk) {
+    size_t count = n_balls - first < chunk ? n_balls - first : chunk;
+    const char * source = balls + first * ball_bytes;
+    const char * next = source + count * ball_bytes;
+
+    /* read the next chunk ahead while this one is transferred */
+    if (first + count < n_balls) {
+      size_t next_count = n_balls - first - count < chunk ? n_balls - first - count : chunk;
+      advise_chunk(next, next + next_count * ball_bytes);
+    }
+
+    if (COMPACT) {
+      int count_arg = (int)count, first_arg = (int)first;
+      err  = clEnqueueWriteBuffer(QUEUE, staging, CL_FALSE, 0,
+        count * ball_bytes, source, 0, NULL, NULL);
+      err |= clSetKernelArg(PACK_KERNEL, 0, sizeof(cl_mem), &staging);
+      err |= clSetKernelArg(PACK_KERNEL, 1, sizeof(int), &count_arg);
+      err |= clSetKernelArg(PACK_KERNEL, 2, sizeof(int), &first_arg);
+      err |= clSetKernelArg(PACK_KERNEL, 3, sizeof(cl_mem), &DEVICE_BALLS);
+      err |= clSetKernelArg(PACK_KERNEL, 4, sizeof(int), &width);
+      err |= clSetKernelArg(PACK_KERNEL, 5, sizeof(int), &height);
+      err |= clSetKernelArg(PACK_KERNEL, 6, sizeof(float), &RADIUS);
+      err |= clEnqueueNDRangeKernel(QUEUE, PACK_KERNEL, 1, NULL, &count,
+        NULL, 0, NULL, NULL);
+    }
+    else {
+      err = clEnqueueWriteBuffer(QUEUE, DEVICE_BALLS, CL_FALSE,
+        first * ball_bytes, count * ball_bytes, source, 0, NULL, NULL);
+    }
+    if (device_shadow_allocated) {
+      err |= clEnqueueWriteBuffer(QUEUE, DEVICE_SHADOW_BALLS, CL_FALSE,
+        first * ball_bytes, count * ball_bytes, source, 0, NULL, NULL);
+    }
+    if (err != CL_SUCCESS) goto failed;
+  }
+
+  /* the mapping is read until the last write is done */
+  err = clFinish(QUEUE);
+  if (err != CL_SUCCESS) goto failed;
+  if (staging) clReleaseMemObject(staging);
+  munmap(LOAD_MAP, LOAD_SIZE);
+  LOAD_MAP = NULL;
+  printf("loaded %zu balls from %s\n", n_balls, LOAD);
+  return 0;
+
+  failed:
+    fprintf(stderr, "error loading the balls: %s\n", util_error_message(err));
+    clFinish(QUEUE);
+    if (staging) clReleaseMemObject(staging);
+  unmap:
+    munmap(LOAD_MAP, LOAD_SIZE);
+    LOAD_MAP = NULL;
+    return -1;
+}
+
+/* Ask the kernel to read the pages from `start` to `end` of the mapped
+ * particle file ahead.
+ */
+static void advise_chunk(const char * start, const char * end) {
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t first = (uintptr_t)start & ~(page - 1);
+  madvise((void *)first, (uintptr_t)end - first, MADV_WILLNEED);
+}
+
+
+
+
+
+/* #############################################################################
+ * #                                  CONTROLS                                 #
+ */
+
+/* Stops the execution of the app
+ */
+static void destroy_window(void) {
+  gtk_main_quit();
+}
+
+/* Reads keyboard input and acts accordingly
+ */
+static gint keyboard_input(GtkWidget *widget, GdkEventKey *event) {
+  if (event->type != GDK_KEY_PRESS) return FALSE;
+
+  /* for the input latency (see record_frame) */
+  if (!INPUT_TIME) INPUT_TIME = g_get_monotonic_time();
+
+  switch(event->keyval) {
+    case GDK_KEY_Up:
+    FY -= FORCE;
+    printf("FY: %f\n", FY);
+    break;
+
+    case GDK_KEY_Down:
+    FY += FORCE;
+    printf("FY: %f\n", FY);
+    break;
+
+    case GDK_KEY_Left:
+    FX -= FORCE;
+    printf("FX: %f\n", FX);
+    break;
+
+    case GDK_KEY_Right:
+    FX += FORCE;
+    printf("FX: %f\n", FX);
+    break;
+
+    case GDK_KEY_a:
+    TRACE -= PRECISION;
+    printf("TRACE: %f\n", TRACE);
+    break;
+
+    case GDK_KEY_d:
+    TRACE += PRECISION;
+    printf("TRACE: %f\n", TRACE);
+    break;
+
+    /* BREAKS IN SOME CASES: when a ball is on the edge and the radius is
+     * increased, the ball gets clipped and it could cause an error */
+    // case GDK_KEY_w:
+    // RADIUS = (float)((int)(RADIUS + 1) % 400);
+    // printf("RADIUS: %f\n", RADIUS);
+    // break;
+    //
+    // case GDK_KEY_s:
+    // RADIUS -= 1;
+    // printf("RADIUS: %f\n", RADIUS);
+    // break;
+
+    case GDK_KEY_r:
     R = 255; G = 0; B = 0;
     printf("COLOUR: RED (%u, %u, %u)\n", R, G, B);
     break;
@@ -507,32 +2051,83 @@ static gint keyboard_input(GtkWidget *widget, GdkEventKey *event) {
     printf("COLOUR: INITIAL (%u, %u, %u)\n", R, G, B);
     break;
 
+    /* cycle the force field: none, file (if given), vortex, sink */
+    case GDK_KEY_f: {
+      int source = FIELD_SOURCE;
+      do {
+        source = (source + 1) % (FIELD_SINK + 1);
+      } while ((source == FIELD_FILE && !field_is_file()) || set_field(source));
+      if (source == FIELD_NONE) printf("FIELD: none\n");
+      break;
+    }
+
+    /* reload the force field file (to see changes to it) */
+    case GDK_KEY_L:
+    if (FIELD_SOURCE == FIELD_FILE) set_field(FIELD_FILE);
+    break;
+
+    /* pan the view by PAN_STEP of its size */
+    case GDK_KEY_h:
+    set_view(VIEW_X - PAN_STEP * WINDOW_WIDTH / ZOOM, VIEW_Y, ZOOM);
+    break;
+
+    case GDK_KEY_l:
+    set_view(VIEW_X + PAN_STEP * WINDOW_WIDTH / ZOOM, VIEW_Y, ZOOM);
+    break;
+
+    case GDK_KEY_k:
+    set_view(VIEW_X, VIEW_Y - PAN_STEP * WINDOW_HEIGHT / ZOOM, ZOOM);
+    break;
+
+    case GDK_KEY_j:
+    set_view(VIEW_X, VIEW_Y + PAN_STEP * WINDOW_HEIGHT / ZOOM, ZOOM);
+    break;
+
+    /* zoom around the centre of the view, or show the whole world */
+    case GDK_KEY_plus:
+    case GDK_KEY_equal:
+    case GDK_KEY_KP_Add:
+    zoom_view(ZOOM * ZOOM_STEP);
+    break;
+
+    case GDK_KEY_minus:
+    case GDK_KEY_KP_Subtract:
+    zoom_view(ZOOM / ZOOM_STEP);
+    break;
+
+    case GDK_KEY_0:
+    set_view(0.0f, 0.0f, fminf((float)WINDOW_WIDTH / world_width(),
+      (float)WINDOW_HEIGHT / world_height()));
+    break;
+
     case GDK_KEY_Q:
     case GDK_KEY_q:
     gtk_main_quit();
-    break;
+    return TRUE;
 
     default:
     return FALSE;
   }
+
+  /* the change may set the sleeping balls in motion */
+  wake_balls();
   return TRUE;
 }
 
 #if WINDOW_IS_RESIZABLE
-static gint resize_pixbuf(GtkWidget *widget, GdkEventConfigure * event) {
-  if (PIXBUF) {
-    int width = gdk_pixbuf_get_width(PIXBUF);
-    int height = gdk_pixbuf_get_height(PIXBUF);
-    if (width == widget->allocation.width && height == widget->allocation.height) {
-      return FALSE;
-    }
-    g_object_unref(PIXBUF);
+static gint resize_frame(GtkWidget *widget, GdkEventConfigure * event) {
+  if (WINDOW_WIDTH == widget->allocation.width
+      && WINDOW_HEIGHT == widget->allocation.height) {
+    return FALSE;
   }
 
-  PIXBUF = gdk_pixbuf_new(GDK_COLORSPACE_RGB, 0, 8,
-    widget->allocation.width, widget->allocation.height);
+  WINDOW_WIDTH = widget->allocation.width;
+  WINDOW_HEIGHT = widget->allocation.height;
+  set_render_scale(RENDER_SCALE);
+  set_view(VIEW_X, VIEW_Y, ZOOM);
 
-  allocate_device_pixels();
+  /* The obstacles are stretched to the world, which may follow the window */
+  if (!WORLD_WIDTH || !WORLD_HEIGHT) compute_sdf();
 
   update_and_draw_balls(widget);
 
@@ -544,6 +2139,158 @@ static gint resize_pixbuf(GtkWidget *widget, GdkEventConfigure * event) {
 
 
 
+/* #############################################################################
+ * #                                   FRAME                                   #
+ */
+
+/* (Re)allocate the host frame with the given size.
+ * With PRESENT_WITH_CAIRO the frame is a CAIRO_FORMAT_RGB24 image surface, in
+ * which every pixel is a native-endian 32-bit 0x00RRGGBB word. This is the
+ * format X servers use for 24/32-bit visuals, so cairo can push it to the
+ * window as is (through MIT-SHM when the server supports it), without the
+ * per-pixel conversion and socket copy that gdk_draw_pixbuf does on RGB data.
+ */
+static void allocate_frame(int width, int height) {
+  #if PRESENT_WITH_CAIRO
+  if (SURFACE) cairo_surface_destroy(SURFACE);
+  SURFACE = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+  #else
+  if (PIXBUF) g_object_unref(PIXBUF);
+  PIXBUF = gdk_pixbuf_new(GDK_COLORSPACE_RGB, 0, 8, width, height);
+  #endif
+}
+
+/* Render the frame at `scale` times the window size, and reallocate the device
+ * pixels to match. The traces start over.
+ */
+static void set_render_scale(float scale) {
+  RENDER_SCALE = scale;
+  allocate_frame(MAX(1, (int)(WINDOW_WIDTH * scale)),
+    MAX(1, (int)(WINDOW_HEIGHT * scale)));
+  allocate_device_pixels();
+}
+
+/* Size of the world, in which the balls move: world_w= and world_h=, or the
+ * size of the window where they are 0.
+ */
+static int world_width(void) {
+  return WORLD_WIDTH > 0 ? (int)WORLD_WIDTH : WINDOW_WIDTH;
+}
+
+static int world_height(void) {
+  return WORLD_HEIGHT > 0 ? (int)WORLD_HEIGHT : WINDOW_HEIGHT;
+}
+
+/* Show the world from (x, y) at `zoom` window pixels per world pixel, kept
+ * within MIN_ZOOM and MAX_ZOOM, and within the world as far as it fills the
+ * window. The traces start over, as they were drawn from the previous view.
+ */
+static void set_view(float x, float y, float zoom) {
+  zoom = fminf(fmaxf(zoom, MIN_ZOOM), MAX_ZOOM);
+  x = fmaxf(fminf(x, world_width() - WINDOW_WIDTH / zoom), 0.0f);
+  y = fmaxf(fminf(y, world_height() - WINDOW_HEIGHT / zoom), 0.0f);
+  if (x == VIEW_X && y == VIEW_Y && zoom == ZOOM) return;
+
+  VIEW_X = x;
+  VIEW_Y = y;
+  ZOOM = zoom;
+  size_t size = sizeof(unsigned char)*frame_row_stride()*frame_height();
+  if (device_pixels_allocated) clear_buffer(DEVICE_PIXELS, size);
+  if (device_trails_allocated) clear_buffer(DEVICE_COLOURS, size);
+  printf("VIEW: (%f, %f) x%f\n", VIEW_X, VIEW_Y, ZOOM);
+}
+
+/* Zoom to `zoom` around the centre of the window (see set_view).
+ */
+static void zoom_view(float zoom) {
+  float centre_x = VIEW_X + WINDOW_WIDTH / ZOOM / 2;
+  float centre_y = VIEW_Y + WINDOW_HEIGHT / ZOOM / 2;
+  zoom = fminf(fmaxf(zoom, MIN_ZOOM), MAX_ZOOM);
+  set_view(centre_x - WINDOW_WIDTH / zoom / 2,
+    centre_y - WINDOW_HEIGHT / zoom / 2, zoom);
+}
+
+/* Getters for the geometry and the pixels of the host frame. Return 0 (NULL)
+ * if no frame was allocated yet.
+ */
+static int frame_width(void) {
+  #if PRESENT_WITH_CAIRO
+  return SURFACE ? cairo_image_surface_get_width(SURFACE) : 0;
+  #else
+  return PIXBUF ? gdk_pixbuf_get_width(PIXBUF) : 0;
+  #endif
+}
+
+static int frame_height(void) {
+  #if PRESENT_WITH_CAIRO
+  return SURFACE ? cairo_image_surface_get_height(SURFACE) : 0;
+  #else
+  return PIXBUF ? gdk_pixbuf_get_height(PIXBUF) : 0;
+  #endif
+}
+
+static int frame_row_stride(void) {
+  #if PRESENT_WITH_CAIRO
+  return SURFACE ? cairo_image_surface_get_stride(SURFACE) : 0;
+  #else
+  return PIXBUF ? gdk_pixbuf_get_rowstride(PIXBUF) : 0;
+  #endif
+}
+
+static int frame_n_channels(void) {
+  #if PRESENT_WITH_CAIRO
+  return 4;
+  #else
+  return PIXBUF ? gdk_pixbuf_get_n_channels(PIXBUF) : 0;
+  #endif
+}
+
+static unsigned char * frame_pixels(void) {
+  #if PRESENT_WITH_CAIRO
+  return SURFACE ? cairo_image_surface_get_data(SURFACE) : NULL;
+  #else
+  return PIXBUF ? gdk_pixbuf_get_pixels(PIXBUF) : NULL;
+  #endif
+}
+
+/* Show the host frame in the window.
+ */
+static void present_frame(GtkWidget * widget) {
+  #if PRESENT_WITH_CAIRO
+  /* the pixels were written behind cairo's back */
+  cairo_surface_mark_dirty(SURFACE);
+
+  cairo_t * cr = gdk_cairo_create(widget->window);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  /* stretched to the window if rendered at a lower resolution */
+  if (RENDER_SCALE != 1.0f) {
+    cairo_scale(cr, (double)WINDOW_WIDTH / frame_width(),
+      (double)WINDOW_HEIGHT / frame_height());
+  }
+  cairo_set_source_surface(cr, SURFACE, 0, 0);
+  cairo_paint(cr);
+  cairo_destroy(cr);
+  #else
+  if (RENDER_SCALE != 1.0f) {
+    GdkPixbuf * scaled = gdk_pixbuf_scale_simple(PIXBUF, WINDOW_WIDTH,
+      WINDOW_HEIGHT, GDK_INTERP_BILINEAR);
+    gdk_draw_pixbuf(widget->window, NULL, scaled,
+      0, 0, 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT,
+      GDK_RGB_DITHER_NONE, 0, 0);
+    g_object_unref(scaled);
+  }
+  else {
+    gdk_draw_pixbuf(widget->window, NULL, PIXBUF,
+      0, 0, 0, 0, frame_width(), frame_height(),
+      GDK_RGB_DITHER_NONE, 0, 0);
+  }
+  #endif
+}
+
+
+
+
+
 /* #############################################################################
  * #                                  OPENCL                                   #
  */
@@ -563,29 +2310,48 @@ static void initialize_opencl_framework(void) {
     goto device_unavailable;
   }
 
-  if (util_compile_kernel(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
-		random_init_kernel, DEVICE, CONTEXT, &INIT_KERNEL) != 0) {
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+		COMPACT ? random_init_compact_kernel : random_init_kernel,
+    KERNEL_CONSTANTS, DEVICE, CONTEXT, &INIT_KERNEL) != 0) {
     goto cleanup_init_kernel;
   }
-  if (util_compile_kernel(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
-		image_alpha_kernel, DEVICE, CONTEXT, &ALPHA_KERNEL) != 0) {
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+		image_alpha_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &ALPHA_KERNEL) != 0) {
     goto cleanup_alpha_kernel;
   }
-  if (util_compile_kernel(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
-		update_balls_kernel, DEVICE, CONTEXT, &BALLS_KERNEL) != 0) {
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+		COMPACT ? update_balls_compact_kernel : update_balls_kernel,
+    KERNEL_CONSTANTS, DEVICE, CONTEXT, &BALLS_KERNEL) != 0) {
     goto cleanup_balls_kernel;
   }
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+		field_analytic_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &FIELD_KERNEL) != 0) {
+    goto cleanup_field_kernel;
+  }
 
-  QUEUE = clCreateCommandQueue(CONTEXT, DEVICE, 0, &err);
+  /* profiling costs a little on every command: only with metrics */
+  QUEUE = clCreateCommandQueue(CONTEXT, DEVICE,
+    METRICS ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
   if (err != CL_SUCCESS) {
     fprintf(stderr, "failed to create command queue\n%s\n", util_error_message(err));
     goto cleanup_queue;
   }
 
+  util_reset_kernel_args(&ALPHA_ARGS, ALPHA_KERNEL);
+  util_reset_kernel_args(&BALLS_ARGS, BALLS_KERNEL);
   opencl_framework_available = 1;
+
+  /* Kernels for optional features */
+  if (COMPACT == 2) initialize_shadow_kernels();
+  if (OBSTACLES) initialize_obstacle_kernels();
+  if (LAZY) initialize_trail_kernels();
+  if (SLEEP_SPEED > 0) initialize_sleep_kernels();
+  if (LOAD && COMPACT) initialize_load_kernels();
   return;
 
   cleanup_queue:
+    clReleaseKernel(FIELD_KERNEL);
+  cleanup_field_kernel:
     clReleaseKernel(BALLS_KERNEL);
   cleanup_balls_kernel:
     clReleaseKernel(ALPHA_KERNEL);
@@ -598,10 +2364,113 @@ static void initialize_opencl_framework(void) {
     return;
 }
 
+/* Compile the kernels for the fp32 shadow run of compact=2. This is only a
+ * check: if it is unavailable, go on without.
+ */
+static void initialize_shadow_kernels(void) {
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      random_init_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &SHADOW_INIT_KERNEL) != 0) {
+    goto shadow_unavailable;
+  }
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      update_balls_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &SHADOW_KERNEL) != 0) {
+    goto cleanup_shadow_kernel;
+  }
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      compact_divergence_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &DIVERGENCE_KERNEL) != 0) {
+    goto cleanup_divergence_kernel;
+  }
+  util_reset_kernel_args(&SHADOW_ARGS, SHADOW_KERNEL);
+  shadow_kernels_available = 1;
+  return;
+
+  cleanup_divergence_kernel:
+    clReleaseKernel(SHADOW_KERNEL);
+  cleanup_shadow_kernel:
+    clReleaseKernel(SHADOW_INIT_KERNEL);
+  shadow_unavailable:
+    fprintf(stderr, "compact format check unavailable, using compact=1\n");
+    COMPACT = 1;
+}
+
+/* Compile the kernels for the obstacles. If they are unavailable, go on
+ * without obstacles.
+ */
+static void initialize_obstacle_kernels(void) {
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      jfa_init_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &JFA_INIT_KERNEL) != 0) {
+    goto obstacles_unavailable;
+  }
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      jfa_step_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &JFA_STEP_KERNEL) != 0) {
+    goto cleanup_step_kernel;
+  }
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      jfa_distance_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &JFA_DISTANCE_KERNEL) != 0) {
+    goto cleanup_distance_kernel;
+  }
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      draw_obstacles_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &OBSTACLES_KERNEL) != 0) {
+    goto cleanup_obstacles_kernel;
+  }
+  obstacle_kernels_available = 1;
+  return;
+
+  cleanup_obstacles_kernel:
+    clReleaseKernel(JFA_DISTANCE_KERNEL);
+  cleanup_distance_kernel:
+    clReleaseKernel(JFA_STEP_KERNEL);
+  cleanup_step_kernel:
+    clReleaseKernel(JFA_INIT_KERNEL);
+  obstacles_unavailable:
+    fprintf(stderr, "obstacles unavailable, going on without\n");
+}
+
+/* Compile the kernel of the lazy trails. If it is unavailable, dim the trails
+ * at every step.
+ */
+static void initialize_trail_kernels(void) {
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      resolve_trails_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &RESOLVE_KERNEL) != 0) {
+    fprintf(stderr, "lazy trails unavailable, using lazy=0\n");
+    LAZY = 0;
+    return;
+  }
+  trail_kernels_available = 1;
+}
+
+/* Compile the kernel listing the awake balls. If it is unavailable, balls
+ * never sleep.
+ */
+static void initialize_sleep_kernels(void) {
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      active_list_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &ACTIVE_KERNEL) != 0) {
+    fprintf(stderr, "sleeping balls unavailable, using sleep=0\n");
+    SLEEP_SPEED = 0;
+    return;
+  }
+  sleep_kernels_available = 1;
+}
+
+/* Compile the kernel packing loaded balls into the compact format. If it is
+ * unavailable, load_balls fails.
+ */
+static void initialize_load_kernels(void) {
+  if (util_compile_kernel_with_options(kernel_sources, sizeof(kernel_sources)/sizeof(const char *),
+      pack_compact_kernel, KERNEL_CONSTANTS, DEVICE, CONTEXT, &PACK_KERNEL) != 0) {
+    return;
+  }
+  pack_kernel_available = 1;
+}
+
 /* Cleanup everything.
  */
 static void shutdown_opencl_framework(void) {
   if (opencl_framework_available) {
+    for (int i = 0; i < balls_variants_count; ++i) {
+      if (BALLS_VARIANTS[i].available) clReleaseKernel(BALLS_VARIANTS[i].args.kernel);
+    }
+    balls_variants_count = 0;
     clReleaseKernel(BALLS_KERNEL);
     clReleaseKernel(ALPHA_KERNEL);
     clReleaseKernel(INIT_KERNEL);
@@ -615,6 +2484,65 @@ static void shutdown_opencl_framework(void) {
       clReleaseMemObject(DEVICE_BALLS);
       device_balls_allocated = 0;
     }
+    if (device_shadow_allocated) {
+      clReleaseMemObject(DEVICE_SHADOW_BALLS);
+      clReleaseMemObject(DEVICE_DISTANCES);
+      device_shadow_allocated = 0;
+    }
+    if (shadow_kernels_available) {
+      clReleaseKernel(DIVERGENCE_KERNEL);
+      clReleaseKernel(SHADOW_KERNEL);
+      clReleaseKernel(SHADOW_INIT_KERNEL);
+      shadow_kernels_available = 0;
+    }
+    if (device_sdf_allocated) {
+      clReleaseMemObject(DEVICE_SDF);
+      device_sdf_allocated = 0;
+    }
+    if (device_field_allocated) {
+      clReleaseMemObject(DEVICE_FIELD);
+      device_field_allocated = 0;
+    }
+    if (FIELD_WRITTEN) {
+      clReleaseEvent(FIELD_WRITTEN);
+      free(FIELD_HOST);
+      FIELD_WRITTEN = NULL;
+    }
+    clReleaseKernel(FIELD_KERNEL);
+    if (device_trails_allocated) {
+      clReleaseMemObject(DEVICE_STAMPS);
+      clReleaseMemObject(DEVICE_COLOURS);
+      device_trails_allocated = 0;
+    }
+    if (trail_kernels_available) {
+      clReleaseKernel(RESOLVE_KERNEL);
+      trail_kernels_available = 0;
+    }
+    if (device_rest_allocated) {
+      clReleaseMemObject(DEVICE_REST);
+      device_rest_allocated = 0;
+    }
+    if (device_sleep_allocated) {
+      clReleaseMemObject(DEVICE_ACTIVE_COUNT);
+      clReleaseMemObject(DEVICE_ACTIVE);
+      clReleaseMemObject(DEVICE_SLEEP);
+      device_sleep_allocated = 0;
+    }
+    if (sleep_kernels_available) {
+      clReleaseKernel(ACTIVE_KERNEL);
+      sleep_kernels_available = 0;
+    }
+    if (pack_kernel_available) {
+      clReleaseKernel(PACK_KERNEL);
+      pack_kernel_available = 0;
+    }
+    if (obstacle_kernels_available) {
+      clReleaseKernel(OBSTACLES_KERNEL);
+      clReleaseKernel(JFA_DISTANCE_KERNEL);
+      clReleaseKernel(JFA_STEP_KERNEL);
+      clReleaseKernel(JFA_INIT_KERNEL);
+      obstacle_kernels_available = 0;
+    }
     opencl_framework_available = 0;
   }
 }
@@ -628,8 +2556,8 @@ static void allocate_device_pixels(void) {
       device_pixels_allocated = 0;
     }
     cl_int err;
-    int rows = gdk_pixbuf_get_height(PIXBUF);
-    int row_stride = gdk_pixbuf_get_rowstride(PIXBUF);
+    int rows = frame_height();
+    int row_stride = frame_row_stride();
 
     DEVICE_PIXELS = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
       sizeof(unsigned char)*row_stride*rows, NULL, &err);
@@ -642,6 +2570,59 @@ static void allocate_device_pixels(void) {
       return;
     }
     device_pixels_allocated = 1;
+    forget_kernel_args();
+
+    /* undimmed colours and steps of the lazy trails, starting black */
+    if (trail_kernels_available) {
+      if (device_trails_allocated) {
+        clReleaseMemObject(DEVICE_STAMPS);
+        clReleaseMemObject(DEVICE_COLOURS);
+        device_trails_allocated = 0;
+      }
+      size_t size = sizeof(unsigned char)*row_stride*rows;
+      size_t stamps_size = sizeof(cl_uint)*(row_stride/frame_n_channels())*rows;
+      void * zeros = calloc(1, size > stamps_size ? size : stamps_size);
+      if (!zeros) {
+        fprintf(stderr, "out of memory for the lazy trails\n");
+        return;
+      }
+      DEVICE_COLOURS = clCreateBuffer(CONTEXT,
+        CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, zeros, &err);
+      if (err != CL_SUCCESS) {
+        fprintf(stderr, "failed to create trail colours buffer on device\n%s\n",
+          util_error_message(err));
+        free(zeros);
+        return;
+      }
+      DEVICE_STAMPS = clCreateBuffer(CONTEXT,
+        CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, stamps_size, zeros, &err);
+      free(zeros);
+      if (err != CL_SUCCESS) {
+        fprintf(stderr, "failed to create trail stamps buffer on device\n%s\n",
+          util_error_message(err));
+        clReleaseMemObject(DEVICE_COLOURS);
+        return;
+      }
+      TRAIL_NOW = 0;
+      device_trails_allocated = 1;
+    }
+
+    /* the sleeping balls, drawn again when they wake up */
+    if (sleep_kernels_available) {
+      if (device_rest_allocated) {
+        clReleaseMemObject(DEVICE_REST);
+        device_rest_allocated = 0;
+      }
+      DEVICE_REST = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
+        sizeof(unsigned char)*row_stride*rows, NULL, &err);
+      if (err != CL_SUCCESS) {
+        fprintf(stderr, "failed to create rest buffer on device\n%s\n",
+          util_error_message(err));
+        return;
+      }
+      device_rest_allocated = 1;
+      wake_balls();
+    }
   }
 }
 
@@ -655,7 +2636,7 @@ static void allocate_device_balls(void) {
     int n_balls = (int)N;
 
     DEVICE_BALLS = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
-      sizeof(float)*n_balls*4, NULL, &err);
+      ball_size()*n_balls, NULL, &err);
     if (err != CL_SUCCESS) {
       fprintf(stderr,
 		    "failed to create balls buffer on device\n%s\n"
@@ -665,9 +2646,105 @@ static void allocate_device_balls(void) {
       return;
     }
     device_balls_allocated = 1;
+    forget_kernel_args();
+
+    /* fp32 shadow balls and their distances for the compact format check */
+    if (shadow_kernels_available && !device_shadow_allocated) {
+      DEVICE_SHADOW_BALLS = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
+        sizeof(float)*n_balls*4, NULL, &err);
+      if (err != CL_SUCCESS) {
+        fprintf(stderr, "failed to create shadow balls buffer on device\n%s\n",
+          util_error_message(err));
+        return;
+      }
+      DEVICE_DISTANCES = clCreateBuffer(CONTEXT, CL_MEM_WRITE_ONLY,
+        sizeof(float)*n_balls, NULL, &err);
+      if (err != CL_SUCCESS) {
+        fprintf(stderr, "failed to create distances buffer on device\n%s\n",
+          util_error_message(err));
+        clReleaseMemObject(DEVICE_SHADOW_BALLS);
+        return;
+      }
+      device_shadow_allocated = 1;
+    }
+
+    /* steps each ball has been still for, and the list of the awake ones */
+    if (sleep_kernels_available) {
+      if (device_sleep_allocated) {
+        clReleaseMemObject(DEVICE_ACTIVE_COUNT);
+        clReleaseMemObject(DEVICE_ACTIVE);
+        clReleaseMemObject(DEVICE_SLEEP);
+        device_sleep_allocated = 0;
+      }
+      DEVICE_SLEEP = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
+        sizeof(cl_uint)*n_balls, NULL, &err);
+      if (err != CL_SUCCESS) goto sleep_unavailable;
+      DEVICE_ACTIVE = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
+        sizeof(cl_uint)*n_balls, NULL, &err);
+      if (err != CL_SUCCESS) goto cleanup_sleep;
+      DEVICE_ACTIVE_COUNT = clCreateBuffer(CONTEXT, CL_MEM_READ_WRITE,
+        sizeof(cl_uint), NULL, &err);
+      if (err != CL_SUCCESS) goto cleanup_active;
+      device_sleep_allocated = 1;
+      wake_balls();
+    }
+    return;
+
+    cleanup_active:
+      clReleaseMemObject(DEVICE_ACTIVE);
+    cleanup_sleep:
+      clReleaseMemObject(DEVICE_SLEEP);
+    sleep_unavailable:
+      fprintf(stderr, "failed to create sleep buffers on device, balls never sleep\n%s\n",
+        util_error_message(err));
   }
 }
 
+/* Number of bytes of a ball on the device: (x, y, vx, vy) as four floats, or
+ * as two 16-bit fixed point numbers and two halfs in the compact format.
+ */
+static size_t ball_size(void) {
+  return COMPACT ? 4 * sizeof(cl_ushort) : 4 * sizeof(float);
+}
+
+/* A new buffer may get the handle of one just released: set all the arguments
+ * of the per-frame kernels again at their next launch.
+ */
+static void forget_kernel_args(void) {
+  util_reset_kernel_args(&ALPHA_ARGS, ALPHA_ARGS.kernel);
+  util_reset_kernel_args(&BALLS_ARGS, BALLS_ARGS.kernel);
+  util_reset_kernel_args(&SHADOW_ARGS, SHADOW_ARGS.kernel);
+  for (int i = 0; i < balls_variants_count; ++i) {
+    util_reset_kernel_args(&BALLS_VARIANTS[i].args, BALLS_VARIANTS[i].args.kernel);
+  }
+}
+
+/* Add the device time of the command of `event`, a `stage` of the frames, to
+ * the metrics once it completes, without waiting for it here. Needs the
+ * profiling queue (see initialize_opencl_framework). Takes `event` over.
+ */
+static void profile_stage(int stage, cl_event event) {
+  if (clSetEventCallback(event, CL_COMPLETE, stage_profiled,
+      (void *)(intptr_t)stage) != CL_SUCCESS) {
+    clReleaseEvent(event);
+  }
+}
+
+/* Called by the OpenCL runtime, possibly from a thread of its own, when the
+ * command of `event` is complete (see profile_stage).
+ */
+static void CL_CALLBACK stage_profiled(cl_event event, cl_int status, void * data) {
+  cl_ulong start, end;
+  if (status == CL_COMPLETE
+      && clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+        sizeof(cl_ulong), &start, NULL) == CL_SUCCESS
+      && clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+        sizeof(cl_ulong), &end, NULL) == CL_SUCCESS) {
+    metrics_stage((int)(intptr_t)data, end - start);
+  }
+  clReleaseEvent(event);
+}
+
 
 
 
@@ -680,6 +2757,10 @@ static void allocate_device_balls(void) {
  */
 static void print_balls(void) {
   cl_int err;
+  if (COMPACT) {
+    fprintf(stderr, "print_balls: the compact format is not supported\n");
+    return;
+  }
   float * BALLS = malloc(N * 4 * sizeof(float));
   err = clEnqueueReadBuffer(QUEUE, DEVICE_BALLS, CL_TRUE,
 		0, sizeof(float) * 4 * N,
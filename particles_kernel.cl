@@ -3,15 +3,40 @@
  */
 
 
+/* Balls are stored in one of two formats:
+ * - fp32: (x, y, vx, vy) as four floats, 16 bytes per ball
+ * - compact: (x, y) as 16-bit fixed point fractions of the world size,
+ *   followed by (vx, vy) as half floats, 8 bytes per ball. Kernels unpack a
+ *   ball into registers, work in float, and pack it again.
+ * Helpers:
+ * - init_ball: computes the initial position and velocity of a ball
+ * - move_ball: computes the new position and velocity of a ball with bounce
+ * - load_compact_ball / store_compact_ball: unpack / pack a compact ball
+ */
+#define COMPACT_SCALE 65535.0f
+static void init_ball(int i, float n, int w, int h, float R, float INIT_SPEED, uint seed, int distribution, float * x, float * y, float * vx, float * vy);
+static void move_ball(float * x, float * y, float * vx, float * vy, float * p_x, float * p_y, int w, int h, float FX, float FY, float R, float DELTA, float HEAT, __global const float * sdf, __global const float * field, int field_cols, int field_rows);
+static void load_compact_ball(__global const ushort * b, int w, int h, float * x, float * y, float * vx, float * vy);
+static void store_compact_ball(__global ushort * b, int w, int h, float R, float x, float y, float vx, float vy);
+
+
+/* Initial distributions of the balls (see init_ball) */
+#define DISTRIBUTION_SPIRAL 0
+#define DISTRIBUTION_UNIFORM 1
+#define DISTRIBUTION_BLOB 2
+#define DISTRIBUTION_MAXWELL 3
+
 /* Randomise position and velocity of a single ball. Used at the beginning.
  * Parameters:
  * - balls_data: the memory where the balls are stored linearly with position
  *   and velocity as (x, y, vx, vy)
  * - n: the number of balls
- * - w: the width of the window
- * - h: the height of the window
+ * - w: the width of the world
+ * - h: the height of the world
  * - r: the radius of a ball
  * - s: the MAGIC_SPEED constant
+ * - seed: the seed of the random numbers
+ * - distribution: one of the DISTRIBUTION_* above
  */
 __kernel void
 random_init_kernel(__global float * balls_data,
@@ -19,7 +44,9 @@ random_init_kernel(__global float * balls_data,
 									 int w,
 									 int h,
 									 float RADIUS,
-									 float INIT_SPEED)
+									 float INIT_SPEED,
+									 uint seed,
+									 int distribution)
 {
 
 	int i = get_global_id(0);
@@ -28,18 +55,159 @@ random_init_kernel(__global float * balls_data,
 	/* go to this ball */
 	__global float * b = balls_data + i * 4;
 
-	float spiral_speed = 32;			/* speed at which the spiral will rotate */
-	float u = (i + 1) / (n + 1);	/* unique number in [0,1] for each ball */
-
 	/* set (x, y, vx, vy) for a single ball */
-  *(b)		 = (float)w/2;																			/* center x */
-  *(b + 1) = (float)h/2;																			/* center y */
-  *(b + 2) = cos((float) spiral_speed * u) * u * INIT_SPEED;	/* vx spiral */
-  *(b + 3) = sin((float) spiral_speed * u) * u * INIT_SPEED;	/* vy spiral */
+	float x, y, vx, vy;
+	init_ball(i, n, w, h, RADIUS, INIT_SPEED, seed, distribution, &x, &y, &vx, &vy);
+  *(b)		 = x;
+  *(b + 1) = y;
+  *(b + 2) = vx;
+  *(b + 3) = vy;
 
 	return;
 }
 
+/* Same as random_init_kernel, for balls in the compact format.
+ */
+__kernel void
+random_init_compact_kernel(__global ushort * balls_data,
+													 float n,
+													 int w,
+													 int h,
+													 float RADIUS,
+													 float INIT_SPEED,
+													 uint seed,
+													 int distribution)
+{
+
+	int i = get_global_id(0);
+	if (i >= (int)n) return;
+
+	float x, y, vx, vy;
+	init_ball(i, n, w, h, RADIUS, INIT_SPEED, seed, distribution, &x, &y, &vx, &vy);
+	store_compact_ball(balls_data + i * 4, w, h, RADIUS, x, y, vx, vy);
+}
+
+/* Pack `count` balls given as (x, y, vx, vy) floats into the compact format,
+ * from the ball `first` on. Used to load balls from a file one chunk at a
+ * time, through `staging`.
+ * Parameters:
+ * - staging: the chunk of balls as four floats each
+ * - count: the number of balls in the chunk
+ * - first: the index of the first ball of the chunk
+ * - balls_data: the memory where the compact balls are stored
+ * - w: the width of the world
+ * - h: the height of the world
+ * - r: the radius of a ball
+ */
+__kernel void
+pack_compact_kernel(__global const float * staging,
+										int count,
+										int first,
+										__global ushort * balls_data,
+										int w,
+										int h,
+										float RADIUS)
+{
+
+	int i = get_global_id(0);
+	if (i >= count) return;
+
+	__global const float * b = staging + i * 4;
+	store_compact_ball(balls_data + (first + i) * 4, w, h, RADIUS, b[0], b[1], b[2], b[3]);
+}
+
+/* Helpers for random numbers:
+ * - philox: the Philox4x32-10 counter-based generator (Salmon et al., 2011),
+ *   four random words for a (counter, key) pair, without any state, so each
+ *   ball gets its own independent and reproducible numbers
+ * - uniform: a uint to a float in (0, 1]
+ * - gaussian: two uniforms to two standard normal floats (Box-Muller)
+ */
+static uint4 philox(uint4 counter, uint2 key);
+static float uniform(uint u);
+static float2 gaussian(uint u1, uint u2);
+
+/* Initial position and velocity of ball `i`, depending on `distribution`:
+ * - DISTRIBUTION_SPIRAL: all balls start at the centre and move away on a
+ *   spiral, with speeds up to INIT_SPEED (does not use the seed)
+ * - DISTRIBUTION_UNIFORM: uniform position in the world, uniform direction,
+ *   uniform speed up to INIT_SPEED
+ * - DISTRIBUTION_BLOB: gaussian position around the centre (standard deviation
+ *   of 1/8 of the world), velocity like DISTRIBUTION_UNIFORM
+ * - DISTRIBUTION_MAXWELL: uniform position in the world, gaussian velocity
+ *   components, so that speeds follow the (2D) Maxwell-Boltzmann distribution
+ *   with a root mean square of INIT_SPEED
+ * The random numbers of a ball are Philox(counter = i, key = seed).
+ */
+static void init_ball(int i, float n, int w, int h, float R, float INIT_SPEED, uint seed, int distribution, float * x, float * y, float * vx, float * vy) {
+
+	if (distribution == DISTRIBUTION_SPIRAL) {
+		float spiral_speed = 32;			/* speed at which the spiral will rotate */
+		float u = (i + 1) / (n + 1);	/* unique number in [0,1] for each ball */
+
+	  *x  = (float)w/2;																			/* center x */
+	  *y  = (float)h/2;																			/* center y */
+	  *vx = cos((float) spiral_speed * u) * u * INIT_SPEED;	/* vx spiral */
+	  *vy = sin((float) spiral_speed * u) * u * INIT_SPEED;	/* vy spiral */
+		return;
+	}
+
+	uint4 r = philox((uint4)(i, 0, 0, 0), (uint2)(seed, 0));
+
+	/* position: the space where a ball fits is [R, w - R] x [R, h - R] */
+	if (distribution == DISTRIBUTION_BLOB) {
+		float2 g = gaussian(r.x, r.y);
+		*x = w / 2.0f + g.x * w / 8.0f;
+		*y = h / 2.0f + g.y * h / 8.0f;
+	}
+	else {
+		*x = R + uniform(r.x) * (w - 2 * R);
+		*y = R + uniform(r.y) * (h - 2 * R);
+	}
+	*x = fmin(fmax(*x, R + 1), w - R - 1);
+	*y = fmin(fmax(*y, R + 1), h - R - 1);
+
+	/* velocity */
+	if (distribution == DISTRIBUTION_MAXWELL) {
+		/* each component has variance INIT_SPEED^2 / 2 */
+		float2 g = gaussian(r.z, r.w);
+		*vx = g.x * INIT_SPEED * M_SQRT1_2_F;
+		*vy = g.y * INIT_SPEED * M_SQRT1_2_F;
+	}
+	else {
+		float angle = 2 * M_PI_F * uniform(r.z);
+		float speed = uniform(r.w) * INIT_SPEED;
+		*vx = cos(angle) * speed;
+		*vy = sin(angle) * speed;
+	}
+}
+
+#define PHILOX_M0 0xD2511F53
+#define PHILOX_M1 0xCD9E8D57
+#define PHILOX_W0 0x9E3779B9
+#define PHILOX_W1 0xBB67AE85
+static uint4 philox(uint4 counter, uint2 key) {
+	for (int round = 0; round < 10; ++round) {
+		uint hi0 = mul_hi((uint)PHILOX_M0, counter.x);
+		uint lo0 = PHILOX_M0 * counter.x;
+		uint hi1 = mul_hi((uint)PHILOX_M1, counter.z);
+		uint lo1 = PHILOX_M1 * counter.z;
+		counter = (uint4)(hi1 ^ counter.y ^ key.x, lo1, hi0 ^ counter.w ^ key.y, lo0);
+		key += (uint2)(PHILOX_W0, PHILOX_W1);
+	}
+	return counter;
+}
+
+static float uniform(uint u) {
+	return ((u >> 8) + 1) * (1.0f / 16777216.0f);		/* 24 bits, never 0 */
+}
+
+static float2 gaussian(uint u1, uint u2) {
+	float r = sqrt(-2 * log(uniform(u1)));
+	float a = 2 * M_PI_F * uniform(u2);
+	return (float2)(r * cos(a), r * sin(a));
+}
+
 
 
 
@@ -51,11 +219,14 @@ random_init_kernel(__global float * balls_data,
  * - pixels: the memory where the pixels of the host's pixbuf are stored
  * - size: the number of bytes in the pixels
  * - trace: the dimming factor
+ * - rest: the sleeping balls (see update_balls_kernel), which are not dimmed,
+ *   or NULL if none
  */
 __kernel void
 image_alpha_kernel(__global unsigned char * pixels,
 									 int size,
-									 float trace)
+									 float trace,
+									 __global const unsigned char * rest)
 {
 
   int i = get_global_id(0);
@@ -67,7 +238,67 @@ image_alpha_kernel(__global unsigned char * pixels,
 	 * it fails (silently? There's just no trace like for when it is set to 1).
 	 * With traces under 0 (negative) it becomes cool, with pretty colourful
 	 * traces if the initial colour is not just white. */
-	pixels[i] = pixels[i] * sqrt(sqrt((1 - trace)));
+	unsigned char dimmed = pixels[i] * sqrt(sqrt((1 - trace)));
+	pixels[i] = rest ? max(dimmed, rest[i]) : dimmed;
+}
+
+/* Lazy alternative to image_alpha_kernel: instead of dimming the whole frame
+ * at every step, the balls are drawn at full brightness in `colours`, and the
+ * step of the last write of each pixel is kept in `stamps`. When a frame is
+ * presented, each pixel is resolved as colour * (1 - trace)^(age / 4), the
+ * same decay as image_alpha_kernel applied `age` times.
+ * Parameters:
+ * - colours: the pixels as last drawn, in the layout of the host's pixbuf
+ * - stamps: the step of the last write of each pixel, row_stride / n_channels
+ *   per row
+ * - pixels: the memory where the pixels of the host's pixbuf are stored
+ * - w: the width of the frame
+ * - h: the height of the frame
+ * - row_stride: the row_stride of the host's pixbuf
+ * - n_channels: the number of channels of each pixel in the host's pixbuf
+ * - now: the current step
+ * - trace: the dimming factor
+ * - rest: the sleeping balls, which are not dimmed, or NULL if none
+ */
+__kernel void
+resolve_trails_kernel(__global const unsigned char * colours,
+											__global const uint * stamps,
+											__global unsigned char * pixels,
+											int w,
+											int h,
+											int row_stride,
+											int n_channels,
+											uint now,
+											float trace,
+											__global const unsigned char * rest)
+{
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	if (x >= w || y >= h) return;
+
+	float decay = pow(max(1 - trace, 0.0f), (now - stamps[row_stride / n_channels * y + x]) * 0.25f);
+	int offset = row_stride * y + n_channels * x;
+
+	/* faded out: no need to read the colour */
+	if (decay < 0.5f / 255) {
+		for (int k = 0; k < n_channels; ++k) pixels[offset + k] = 0;
+	}
+	else if (n_channels == 4) {
+		float4 colour = convert_float4(vload4(0, colours + offset));
+		vstore4(convert_uchar4_sat_rte(colour * decay), 0, pixels + offset);
+	}
+	else {
+		for (int k = 0; k < n_channels; ++k) {
+			pixels[offset + k] = convert_uchar_sat_rte(colours[offset + k] * decay);
+		}
+	}
+
+	if (rest) {
+		for (int k = 0; k < n_channels; ++k) {
+			pixels[offset + k] = max(pixels[offset + k], rest[offset + k]);
+		}
+	}
 }
 
 
@@ -80,22 +311,104 @@ image_alpha_kernel(__global unsigned char * pixels,
  *   and velocity as (x, y, vx, vy)
  * - n: the number of balls
  * - pixels: the memory where the pixels of the host's pixbuf are stored
- * - w: the width of the window
- * - h: the height of the window
+ * - w: the width of the world, in which the balls move
+ * - h: the height of the world
  * - row_stride: the row_stride of the host's pixbuf
- * - n_channels: the number of channels of each pixel in the host's pixbuf
+ * - n_channels: the number of channels of each pixel in the host's pixbuf, 4
+ *   means the native 32-bit xRGB format of a cairo RGB24 surface
  * - fx: the x component of the force field
  * - fy: the y component of the force field
  * - r: the radius of a ball
  * - heat: the dissipation factor when hitting a wall
  * - rgb: an int containing three bytes for R, G, and B values for color
+ * - sdf: the signed distance field of the obstacles (w x h floats, see
+ *   jfa_distance_kernel), or NULL if there are no obstacles
+ * - field: a force field added to (fx, fy), as a grid of field_cols x
+ *   field_rows (fx, fy) pairs stretched over the world, or NULL if none
+ * - field_cols: the number of columns of the field
+ * - field_rows: the number of rows of the field
+ * - stamps: the step of the last write of each pixel (see
+ *   resolve_trails_kernel), or NULL if the trails are dimmed at every step
+ * - now: the current step, written in `stamps`
+ * - scale: frame pixels per world pixel: the balls move in the world, and
+ *   are drawn in a frame that may be smaller, or larger when zoomed in
+ * - active: the indices of the balls to update (see active_list_kernel), one
+ *   per work item, or NULL to update all of them
+ * - sleep: the number of steps each ball has been slower than `sleep_speed`,
+ *   or NULL to never let balls sleep. After SLEEP_STEPS steps a ball falls
+ *   asleep: it is drawn in `rest` one last time, and left out of `active`
+ * - rest: the sleeping balls, in the layout of `pixels`
+ * - sleep_speed: the speed under which a ball counts as still
+ * - view_x: the x coordinate in the world of the left of the frame
+ * - view_y: the y coordinate in the world of the top of the frame
+ * - frame_w: the width of the frame; the balls outside it are not drawn
+ * - frame_h: the height of the frame
+ * `pixels` can be NULL to only move the balls without drawing them.
  */
 /* Helpers:
- * - draw_circle: draws a full circle around the given (x,y) coordinates
+ * - draw_in_view: draws a ball seen through the view, unless it is outside
+ * - draw_circle: draws a full circle around the given (x,y) coordinates,
+ *   clipped to the frame
  * - in_circle: checks if a coordinate falls in a radius
+ * - sdf_at: the signed distance field at a pixel, clamped to the world
+ * - field_at: the force field at a position, interpolated bilinearly
  */
-static void draw_circle(int x, int y, int ball, int RADIUS, int n_channels, int row_stride, __global unsigned char * pixels, unsigned int RGB);
+static void draw_in_view(float p_x, float p_y, int ball, float R, float scale, float view_x, float view_y, int frame_w, int frame_h, int n_channels, int row_stride, __global unsigned char * pixels, unsigned int RGB, __global uint * stamps, uint now);
+static void draw_circle(int x, int y, int ball, int RADIUS, int frame_w, int frame_h, int n_channels, int row_stride, __global unsigned char * pixels, unsigned int RGB, __global uint * stamps, uint now);
 static int in_circle(int x, int y, int i, int j, int RADIUS);
+static float sdf_at(__global const float * sdf, int w, int h, int x, int y);
+static float2 field_at(__global const float * field, int cols, int rows, int w, int h, float x, float y);
+static int falls_asleep(__global uint * sleep, int i, float vx, float vy, float sleep_speed);
+
+/* Steps a ball has to be slow for to fall asleep. This and the other shared
+ * constants (ACTIVE_GROUP, ENSEMBLE_GROUP, FIELD_VORTEX, FIELD_SINK) are
+ * defined by particles.c with -D (see KERNEL_CONSTANTS); the defaults are only
+ * for programs that do not use them, such as bench */
+#ifndef SLEEP_STEPS
+#define SLEEP_STEPS 30
+#endif
+
+/* Specialised variants. The host may build the update kernels with
+ * - -D SPEC_N_CHANNELS=c: the pixel format is known
+ * - -D SPEC_RADIUS=r: the radius is known
+ * - -D SPEC_NO_HEAT: there is no energy dissipation
+ * - -D SPEC_NO_SDF: there are no obstacles
+ * - -D SPEC_NO_FIELD: there is no force field
+ * in which case the matching arguments are replaced by constants, so that the
+ * compiler unrolls draw_circle and removes the branches that are never taken.
+ */
+#ifdef SPEC_N_CHANNELS
+#define SPECIALISE_N_CHANNELS(n_channels) (SPEC_N_CHANNELS)
+#else
+#define SPECIALISE_N_CHANNELS(n_channels) (n_channels)
+#endif
+#ifdef SPEC_RADIUS
+#define SPECIALISE_R(R) ((float)(SPEC_RADIUS))
+#else
+#define SPECIALISE_R(R) (R)
+#endif
+#ifdef SPEC_NO_HEAT
+#define SPECIALISE_HEAT(HEAT) (0.0f)
+#else
+#define SPECIALISE_HEAT(HEAT) (HEAT)
+#endif
+#ifdef SPEC_NO_SDF
+#define SPECIALISE_SDF(sdf) (0)
+#else
+#define SPECIALISE_SDF(sdf) (sdf)
+#endif
+#ifdef SPEC_NO_FIELD
+#define SPECIALISE_FIELD(field) (0)
+#else
+#define SPECIALISE_FIELD(field) (field)
+#endif
+#define SPECIALISE() do { \
+	n_channels = SPECIALISE_N_CHANNELS(n_channels); \
+	R = SPECIALISE_R(R); \
+	HEAT = SPECIALISE_HEAT(HEAT); \
+	sdf = SPECIALISE_SDF(sdf); \
+	field = SPECIALISE_FIELD(field); \
+} while (0)
 
 __kernel void
 update_balls_kernel(__global float * balls_data,
@@ -110,18 +423,32 @@ update_balls_kernel(__global float * balls_data,
 										float R,
 										float DELTA,
 										float HEAT,
-										unsigned int RGB)
+										unsigned int RGB,
+										__global const float * sdf,
+										__global const float * field,
+										int field_cols,
+										int field_rows,
+										__global uint * stamps,
+										uint now,
+										float scale,
+										__global const uint * active,
+										__global uint * sleep,
+										__global unsigned char * rest,
+										float sleep_speed,
+										float view_x,
+										float view_y,
+										int frame_w,
+										int frame_h)
 {
 
 	int i = get_global_id(0);
 	if (i >= (int)n) return;
+	if (active) i = active[i];
+	SPECIALISE();
 
-	float t = DELTA;					/* the time interval */
-	int p_x, p_y;							/* coordinates of centre of ball for drawing */
 	__global float * p;				/* to store pointer to this ball */
 	float x, y, vx, vy;				/* position and velocities of this ball */
-	float new_x, new_y;				/* new position of this ball */
-	float new_vx, new_vy;			/* new velocity of this ball */
+	float p_x, p_y;						/* coordinates of centre of ball for drawing */
 
 	/* go to this ball and get data */
 	p = balls_data + i * 4;
@@ -130,57 +457,264 @@ update_balls_kernel(__global float * balls_data,
 	vx = *(p + 2);
 	vy = *(p + 3);
 
+	move_ball(&x, &y, &vx, &vy, &p_x, &p_y, w, h, FX, FY, R, DELTA, HEAT, sdf, field, field_cols, field_rows);
+
+	/* update positions and velocities */
+	*(p)     = x;
+	*(p + 1) = y;
+	*(p + 2) = vx;
+	*(p + 3) = vy;
+
+	/* paint the pixels for this ball, unless only moving (see above) */
+	if (pixels) draw_in_view(p_x, p_y, i, R, scale, view_x, view_y, frame_w, frame_h, n_channels, row_stride, pixels, RGB, stamps, now);
+	if (sleep && falls_asleep(sleep, i, vx, vy, sleep_speed) && rest) {
+		draw_in_view(p_x, p_y, i, R, scale, view_x, view_y, frame_w, frame_h, n_channels, row_stride, rest, RGB, 0, now);
+	}
+}
+
+/* Same as update_balls_kernel, for balls in the compact format.
+ */
+__kernel void
+update_balls_compact_kernel(__global ushort * balls_data,
+														float n,
+														__global unsigned char * pixels,
+														int w,
+														int h,
+														int row_stride,
+														int n_channels,
+														float FX,
+														float FY,
+														float R,
+														float DELTA,
+														float HEAT,
+														unsigned int RGB,
+														__global const float * sdf,
+														__global const float * field,
+														int field_cols,
+														int field_rows,
+														__global uint * stamps,
+														uint now,
+														float scale,
+														__global const uint * active,
+														__global uint * sleep,
+														__global unsigned char * rest,
+														float sleep_speed,
+														float view_x,
+														float view_y,
+														int frame_w,
+														int frame_h)
+{
+
+	int i = get_global_id(0);
+	if (i >= (int)n) return;
+	if (active) i = active[i];
+	SPECIALISE();
+
+	float x, y, vx, vy;				/* position and velocities of this ball */
+	float p_x, p_y;						/* coordinates of centre of ball for drawing */
+
+	load_compact_ball(balls_data + i * 4, w, h, &x, &y, &vx, &vy);
+	move_ball(&x, &y, &vx, &vy, &p_x, &p_y, w, h, FX, FY, R, DELTA, HEAT, sdf, field, field_cols, field_rows);
+	store_compact_ball(balls_data + i * 4, w, h, R, x, y, vx, vy);
+
+	if (pixels) draw_in_view(p_x, p_y, i, R, scale, view_x, view_y, frame_w, frame_h, n_channels, row_stride, pixels, RGB, stamps, now);
+	if (sleep && falls_asleep(sleep, i, vx, vy, sleep_speed) && rest) {
+		draw_in_view(p_x, p_y, i, R, scale, view_x, view_y, frame_w, frame_h, n_channels, row_stride, rest, RGB, 0, now);
+	}
+}
+
+/* List the balls that are awake (slow for less than SLEEP_STEPS steps) in
+ * `active`, for update_balls_kernel. Each work-group counts its awake balls
+ * with a local atomic, then reserves room for all of them with a single
+ * atomic on `count`, so the order of the list is not the order of the balls.
+ * Parameters:
+ * - sleep: the number of steps each ball has been slow for
+ * - n: the number of balls
+ * - active: the list of the indices of the awake balls
+ * - count: the length of the list, which must be 0 before the launch
+ */
+#ifndef ACTIVE_GROUP
+#define ACTIVE_GROUP 64
+#endif
+__kernel __attribute__((reqd_work_group_size(ACTIVE_GROUP, 1, 1))) void
+active_list_kernel(__global const uint * sleep,
+									 float n,
+									 __global uint * active,
+									 __global uint * count)
+{
+
+	__local uint group_count;
+	__local uint group_base;
+
+	int i = get_global_id(0);
+	int awake = i < (int)n && sleep[i] < SLEEP_STEPS;
+
+	if (get_local_id(0) == 0) group_count = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint slot = awake ? atomic_inc(&group_count) : 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (get_local_id(0) == 0) group_base = atomic_add(count, group_count);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (awake) active[group_base + slot] = i;
+}
+
+/* New position and velocity of a single ball, and the coordinates at which it
+ * has to be drawn.
+ */
+static void move_ball(float * x, float * y, float * vx, float * vy, float * p_x, float * p_y, int w, int h, float FX, float FY, float R, float DELTA, float HEAT, __global const float * sdf, __global const float * field, int field_cols, int field_rows) {
+
+	float t = DELTA;					/* the time interval */
+	float new_x, new_y;				/* new position of this ball */
+	float new_vx, new_vy;			/* new velocity of this ball */
+
+	/* add the force field at the current position, if any */
+	if (field) {
+		float2 f = field_at(field, field_cols, field_rows, w, h, *x, *y);
+		FX += f.x;
+		FY += f.y;
+	}
 
 	/* find new position */
-	// new_x = FX * t * t + vx * t + x;
-	// new_y = FY * t * t + vy * t + y;
-	new_x = vx * t + x;															/* don't use FX to keep E */
-	new_y = vy * t + y;															/* don't use FY to keep E */
+	// new_x = FX * t * t + *vx * t + *x;
+	// new_y = FY * t * t + *vy * t + *y;
+	new_x = *vx * t + *x;														/* don't use FX to keep E */
+	new_y = *vy * t + *y;														/* don't use FY to keep E */
 
 	/* check new position, invert velocities if necessary */
 	if (new_x - R <= 0 || new_x + R >= w) {						/* if out of boundaries */
-		vx = - vx;                          						/* invert vx */
-		new_vx = vx * (1 - HEAT);               				/* energy dissipation */
-    p_x = (new_x < w / 2) ? R : w - R;              /* graphical x on edge */
+		new_vx = - *vx * (1 - HEAT);										/* invert vx, energy dissipation */
+    *p_x = (new_x < w / 2) ? R : w - R;             /* graphical x on edge */
 
 		/* more correct physical new position, but results in incorrect height of
 		 * bounce, sometimes even higher than starting point */
-		// if (new_x > w/2) *(p) = w - R - (new_x - w + R);
-		// else *(p) = (fabs((float)new_x - R)) + R;
+		// if (new_x > w/2) new_x = w - R - (new_x - w + R);
+		// else new_x = (fabs((float)new_x - R)) + R;
 	}
 	else {                                            /* else */
-		new_vx = FX * t + vx;														/* update velocity vx */
-		p_x = new_x;																		/* store graphical x */
+		new_vx = FX * t + *vx;													/* update velocity vx */
+		*p_x = new_x;																		/* store graphical x */
 	}
 
 	if (new_y - R <= 0 || new_y + R >= h) {						/* if out of boundaries */
-		vy = - vy;                          						/* invert vy */
-		new_vy = vy * (1 - HEAT);               				/* energy dissipation */
-    p_y = (new_y < h / 2) ? R : h - R;              /* graphical y on edge */
+		new_vy = - *vy * (1 - HEAT);										/* invert vy, energy dissipation */
+    *p_y = (new_y < h / 2) ? R : h - R;             /* graphical y on edge */
 
 		/* more correct physical new position, but results in incorrect height of
 		 * bounce, sometimes even higher than starting point */
-		// if (new_y > h/2) *(p + 1) = h - R - (new_y - h + R);
-		// else *(p + 1) = (fabs((float)new_y - R)) + R;
+		// if (new_y > h/2) new_y = h - R - (new_y - h + R);
+		// else new_y = (fabs((float)new_y - R)) + R;
 	}
 	else {                                            /* else */
-		new_vy = FY * t + vy;														/* update velocity vy */
-		p_y = new_y;																		/* store graphical y */
+		new_vy = FY * t + *vy;													/* update velocity vy */
+		*p_y = new_y;																		/* store graphical y */
 	}
 
-	/* update positions and velocities */
-	*(p)     = new_x;
-	*(p + 1) = new_y;
-	*(p + 2) = new_vx;
-	*(p + 3) = new_vy;
+	/* check new position against the obstacles: a single lookup in the distance
+	 * field, however complex they are. If the ball overlaps an obstacle, reflect
+	 * the velocity on the normal (the gradient of the field) and push the ball
+	 * out along it */
+	if (sdf) {
+		int c_x = (int)new_x, c_y = (int)new_y;
+		float d = sdf_at(sdf, w, h, c_x, c_y);
+		if (d < R) {
+			float n_x = sdf_at(sdf, w, h, c_x + 1, c_y) - sdf_at(sdf, w, h, c_x - 1, c_y);
+			float n_y = sdf_at(sdf, w, h, c_x, c_y + 1) - sdf_at(sdf, w, h, c_x, c_y - 1);
+			float length = hypot(n_x, n_y);
+			if (length > 0) {
+				n_x /= length;
+				n_y /= length;
+				float v_n = new_vx * n_x + new_vy * n_y;
+				if (v_n < 0) {															/* if moving into the obstacle */
+					new_vx = (new_vx - 2 * v_n * n_x) * (1 - HEAT);
+					new_vy = (new_vy - 2 * v_n * n_y) * (1 - HEAT);
+				}
+				/* deep inside an obstacle the push is large: stay within the walls */
+				new_x = clamp(new_x + n_x * (R - d), R, w - R);
+				new_y = clamp(new_y + n_y * (R - d), R, h - R);
+				*p_x = new_x;
+				*p_y = new_y;
+			}
+		}
+	}
+
+	*x  = new_x;
+	*y  = new_y;
+	*vx = new_vx;
+	*vy = new_vy;
+}
+
+/* Unpack a compact ball: positions are fractions of the world size in
+ * 1/65535 steps, velocities are half floats.
+ */
+static void load_compact_ball(__global const ushort * b, int w, int h, float * x, float * y, float * vx, float * vy) {
+	*x  = b[0] * (w / COMPACT_SCALE);
+	*y  = b[1] * (h / COMPACT_SCALE);
+	*vx = vload_half(2, (__global const half *) b);
+	*vy = vload_half(3, (__global const half *) b);
+}
+
+/* Pack a compact ball. Fixed point cannot hold a ball that went past the
+ * edge, so the position is clamped to where the ball is drawn after a bounce.
+ * Velocities are rounded to the nearest half.
+ */
+static void store_compact_ball(__global ushort * b, int w, int h, float R, float x, float y, float vx, float vy) {
+	x = fmin(fmax(x, R), w - R);
+	y = fmin(fmax(y, R), h - R);
+	b[0] = convert_ushort_sat_rte(x * (COMPACT_SCALE / w));
+	b[1] = convert_ushort_sat_rte(y * (COMPACT_SCALE / h));
+	vstore_half_rte(vx, 2, (__global half *) b);
+	vstore_half_rte(vy, 3, (__global half *) b);
+}
+
 
-	/* paint the pixels for this ball */
-	draw_circle(p_x, p_y, i, (int)R, n_channels, row_stride, pixels, RGB);
+
+/* Distance between the position of each ball in the compact format and in a
+ * fp32 copy of the same simulation, used to measure the error of the compact
+ * format.
+ * Parameters:
+ * - compact: the balls in the compact format
+ * - reference: the same balls in the fp32 format
+ * - n: the number of balls
+ * - w: the width of the world
+ * - h: the height of the world
+ * - distances: one float per ball for the result
+ */
+__kernel void
+compact_divergence_kernel(__global const ushort * compact,
+													__global const float * reference,
+													float n,
+													int w,
+													int h,
+													__global float * distances)
+{
+
+	int i = get_global_id(0);
+	if (i >= (int)n) return;
+
+	float x, y, vx, vy;
+	load_compact_ball(compact + i * 4, w, h, &x, &y, &vx, &vy);
+	distances[i] = hypot(x - reference[i * 4], y - reference[i * 4 + 1]);
+}
+
+/* Draw a ball at (p_x, p_y) in the world in the frame, which shows the world
+ * from (view_x, view_y) at `scale` frame pixels per world pixel. The balls
+ * that do not touch the frame are culled, so drawing costs as much as the
+ * visible balls.
+ */
+static void draw_in_view(float p_x, float p_y, int ball, float R, float scale, float view_x, float view_y, int frame_w, int frame_h, int n_channels, int row_stride, __global unsigned char * pixels, unsigned int RGB, __global uint * stamps, uint now) {
+	int x = (int)floor((p_x - view_x) * scale);
+	int y = (int)floor((p_y - view_y) * scale);
+	int radius = max(1, (int)(R * scale));
+	if (x + radius < 0 || y + radius < 0 || x - radius >= frame_w || y - radius >= frame_h) return;
+	draw_circle(x, y, ball, radius, frame_w, frame_h, n_channels, row_stride, pixels, RGB, stamps, now);
 }
 
-/* Draw the pixels for a single ball
+/* Draw the pixels for a single ball, clipped to the frame_w x frame_h frame
+ * With 4 channels the pixel is a native-endian 0x00RRGGBB word (the device is
+ * assumed to share the host's endianness), which is exactly RGB, so it is
+ * stored with a single 32-bit write. Otherwise the pixel is R, G, B bytes.
  */
-static void draw_circle(int x, int y, int ball, int RADIUS, int n_channels, int row_stride, __global unsigned char * pixels, unsigned int RGB) {
+static void draw_circle(int x, int y, int ball, int RADIUS, int frame_w, int frame_h, int n_channels, int row_stride, __global unsigned char * pixels, unsigned int RGB, __global uint * stamps, uint now) {
 
 	__global unsigned char * pixel;
 	unsigned char colors[3];
@@ -188,14 +722,20 @@ static void draw_circle(int x, int y, int ball, int RADIUS, int n_channels, int
 	colors[1] = (unsigned char) ((RGB & 0x00FF00) >> 8);	/* get green */
 	colors[2] = (unsigned char) (RGB & 0x0000FF);					/* get blue */
 
-  for (int j = y - RADIUS; j <= y + RADIUS; ++j) {
-    for (int i = x - RADIUS; i <= x + RADIUS; ++i) {
+  for (int j = max(y - RADIUS, 0); j <= min(y + RADIUS, frame_h - 1); ++j) {
+    for (int i = max(x - RADIUS, 0); i <= min(x + RADIUS, frame_w - 1); ++i) {
       if (in_circle(x, y, i, j, RADIUS)) {
         /* color a single pixel */
         pixel = pixels + row_stride * j + n_channels * i;
-        for (size_t k = 0; k < n_channels; ++k) {
-					pixel[k] = colors[k];
+        if (n_channels == 4) {
+          *((__global unsigned int *) pixel) = RGB;
         }
+        else {
+          for (size_t k = 0; k < n_channels; ++k) {
+						pixel[k] = colors[k];
+          }
+        }
+        if (stamps) stamps[row_stride / n_channels * j + i] = now;
       }
     }
   }
@@ -203,3 +743,334 @@ static void draw_circle(int x, int y, int ball, int RADIUS, int n_channels, int
 static int in_circle(int x, int y, int i, int j, int RADIUS) {
   return (x - i) * (x - i) + (y - j) * (y - j) < RADIUS * RADIUS;
 }
+
+/* Count one more step for ball `i` if it is slower than `sleep_speed`, or
+ * start over if it is not. Returns 1 on the step it falls asleep.
+ */
+static int falls_asleep(__global uint * sleep, int i, float vx, float vy, float sleep_speed) {
+	if (hypot(vx, vy) >= sleep_speed) {
+		sleep[i] = 0;
+		return 0;
+	}
+	return ++sleep[i] == SLEEP_STEPS;
+}
+static float sdf_at(__global const float * sdf, int w, int h, int x, int y) {
+	return sdf[clamp(y, 0, h - 1) * w + clamp(x, 0, w - 1)];
+}
+static float2 field_at(__global const float * field, int cols, int rows, int w, int h, float x, float y) {
+	/* position in cells, the centre of cell (i, j) being at (i, j) */
+	float c_x = clamp(x * cols / w - 0.5f, 0.0f, cols - 1.0f);
+	float c_y = clamp(y * rows / h - 0.5f, 0.0f, rows - 1.0f);
+	int i = (int)c_x, j = (int)c_y;
+	int next_i = min(i + 1, cols - 1), next_j = min(j + 1, rows - 1);
+	float a = c_x - i, b = c_y - j;
+
+	float2 top = mix(vload2(j * cols + i, field), vload2(j * cols + next_i, field), a);
+	float2 bottom = mix(vload2(next_j * cols + i, field), vload2(next_j * cols + next_i, field), a);
+	return mix(top, bottom, b);
+}
+
+
+
+/* Ensembles: M independent simulations of n balls each, in one buffer (member
+ * after member). The second dimension of the NDRange is the member, whose
+ * parameters are a float4 (fx, fy, heat, init_speed) in `params`. Nothing is
+ * drawn: each member is summed up by ensemble_stats_kernel.
+ */
+
+/* Same as random_init_kernel, for every member. Members use the same random
+ * numbers (common random numbers), so their differences only come from their
+ * parameters.
+ */
+__kernel void
+ensemble_init_kernel(__global float * balls_data,
+										 float n,
+										 __global const float4 * params,
+										 int w,
+										 int h,
+										 float RADIUS,
+										 uint seed,
+										 int distribution)
+{
+
+	int i = get_global_id(0);
+	int m = get_global_id(1);
+	if (i >= (int)n) return;
+
+	__global float * b = balls_data + ((size_t)m * (int)n + i) * 4;
+
+	float x, y, vx, vy;
+	init_ball(i, n, w, h, RADIUS, params[m].w, seed, distribution, &x, &y, &vx, &vy);
+  *(b)		 = x;
+  *(b + 1) = y;
+  *(b + 2) = vx;
+  *(b + 3) = vy;
+}
+
+/* Same as update_balls_kernel, for every member, without drawing.
+ */
+__kernel void
+ensemble_update_kernel(__global float * balls_data,
+											 float n,
+											 __global const float4 * params,
+											 int w,
+											 int h,
+											 float R,
+											 float DELTA)
+{
+
+	int i = get_global_id(0);
+	int m = get_global_id(1);
+	if (i >= (int)n) return;
+
+	__global float * p = balls_data + ((size_t)m * (int)n + i) * 4;
+	float4 param = params[m];
+	float x = *(p), y = *(p + 1), vx = *(p + 2), vy = *(p + 3);
+	float p_x, p_y;
+
+	move_ball(&x, &y, &vx, &vy, &p_x, &p_y, w, h, param.x, param.y, R, DELTA, param.z, 0, 0, 0, 0);
+
+	*(p)     = x;
+	*(p + 1) = y;
+	*(p + 2) = vx;
+	*(p + 3) = vy;
+}
+
+/* Statistics of each member: one work-group of ENSEMBLE_GROUP work-items per
+ * member walks its balls and sums them up in local memory.
+ * Parameters:
+ * - balls_data: the balls of all members
+ * - n: the number of balls of a member
+ * - stats: one float4 per member for the result: mean x, mean y, mean speed,
+ *   mean kinetic energy (per unit of mass)
+ */
+#ifndef ENSEMBLE_GROUP
+#define ENSEMBLE_GROUP 64
+#endif
+__kernel __attribute__((reqd_work_group_size(ENSEMBLE_GROUP, 1, 1))) void
+ensemble_stats_kernel(__global const float * balls_data,
+											float n,
+											__global float4 * stats)
+{
+
+	__local float4 sums[ENSEMBLE_GROUP];
+
+	int l = get_local_id(0);
+	int m = get_group_id(0);
+	__global const float * member = balls_data + (size_t)m * (int)n * 4;
+
+	float4 sum = 0;
+	for (int i = l; i < (int)n; i += ENSEMBLE_GROUP) {
+		float vx = member[i * 4 + 2], vy = member[i * 4 + 3];
+		float speed2 = vx * vx + vy * vy;
+		sum += (float4)(member[i * 4], member[i * 4 + 1], sqrt(speed2), speed2 / 2);
+	}
+	sums[l] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = ENSEMBLE_GROUP / 2; stride > 0; stride /= 2) {
+		if (l < stride) sums[l] += sums[l + stride];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (l == 0) stats[m] = sums[0] / n;
+}
+
+
+
+/* Fill a force field grid with an analytic field around the centre of the
+ * world. Cell (i, j) covers the world from (i/cols, j/rows) to
+ * ((i+1)/cols, (j+1)/rows), in fractions of the world size.
+ * Parameters:
+ * - field: cols x rows (fx, fy) pairs for the result
+ * - cols: the number of columns of the field
+ * - rows: the number of rows of the field
+ * - type: FIELD_VORTEX (counterclockwise around the centre) or FIELD_SINK
+ *   (towards the centre)
+ * - strength: the magnitude of the field, reached at 1/16 of the world from
+ *   the centre (it goes linearly to 0 at the centre)
+ */
+#ifndef FIELD_VORTEX
+#define FIELD_VORTEX 2
+#define FIELD_SINK 3
+#endif
+__kernel void
+field_analytic_kernel(__global float * field,
+											int cols,
+											int rows,
+											int type,
+											float strength)
+{
+
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i >= cols || j >= rows) return;
+
+	float d_x = (i + 0.5f) / cols - 0.5f;
+	float d_y = (j + 0.5f) / rows - 0.5f;
+	float r = hypot(d_x, d_y);
+	float magnitude = strength * fmin(r * 16, 1.0f) / fmax(r, 1e-6f);
+
+	float2 f;
+	if (type == FIELD_VORTEX) f = (float2)(d_y, -d_x) * magnitude;
+	else f = (float2)(-d_x, -d_y) * magnitude;
+	vstore2(f, j * cols + i, field);
+}
+
+
+
+/* Signed distance field of the obstacles, with the jump flooding algorithm
+ * (Rong and Tan, 2006): every pixel keeps the closest obstacle pixel and the
+ * closest free pixel it knows of, and looks at what its neighbours at distance
+ * `step` know, for step = size/2, size/4, ..., 1. That takes log2(size) passes
+ * of a kernel over the world, and gives (nearly) exact distances.
+ * The seeds are 4 ints per pixel: (x, y) of the closest obstacle pixel, then
+ * (x, y) of the closest free pixel, with x = -1 when none is known yet.
+ */
+
+/* Set the seeds of every pixel from the mask.
+ * Parameters:
+ * - mask: w x h bytes, non zero for obstacle pixels
+ * - w: the width of the world
+ * - h: the height of the world
+ * - seeds: w x h x 4 ints for the result
+ */
+__kernel void
+jfa_init_kernel(__global const unsigned char * mask,
+								int w,
+								int h,
+								__global int * seeds)
+{
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	if (x >= w || y >= h) return;
+
+	__global int * seed = seeds + (y * w + x) * 4;
+	int obstacle = mask[y * w + x] != 0;
+	seed[0] = obstacle ? x : -1;
+	seed[1] = y;
+	seed[2] = obstacle ? -1 : x;
+	seed[3] = y;
+}
+
+/* One pass of jump flooding, from `in` to `out`.
+ * Parameters:
+ * - in: the seeds after the previous pass
+ * - out: the seeds after this pass
+ * - w: the width of the world
+ * - h: the height of the world
+ * - step: the distance of the neighbours looked at
+ */
+__kernel void
+jfa_step_kernel(__global const int * in,
+								__global int * out,
+								int w,
+								int h,
+								int step)
+{
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	if (x >= w || y >= h) return;
+
+	int best[4] = { -1, 0, -1, 0 };
+	float best_d[2] = { INFINITY, INFINITY };
+
+	for (int j = -1; j <= 1; ++j) {
+		for (int i = -1; i <= 1; ++i) {
+			int n_x = x + i * step, n_y = y + j * step;
+			if (n_x < 0 || n_x >= w || n_y < 0 || n_y >= h) continue;
+			__global const int * seed = in + (n_y * w + n_x) * 4;
+			for (int k = 0; k < 2; ++k) {			/* obstacle, then free */
+				int s_x = seed[2 * k], s_y = seed[2 * k + 1];
+				if (s_x < 0) continue;
+				float d = (float)((s_x - x) * (s_x - x) + (s_y - y) * (s_y - y));
+				if (d < best_d[k]) {
+					best_d[k] = d;
+					best[2 * k] = s_x;
+					best[2 * k + 1] = s_y;
+				}
+			}
+		}
+	}
+
+	__global int * seed = out + (y * w + x) * 4;
+	for (int k = 0; k < 4; ++k) seed[k] = best[k];
+}
+
+/* Turn the seeds into signed distances: positive outside of the obstacles (the
+ * distance to the closest obstacle pixel), negative inside (minus the distance
+ * to the closest free pixel), half a pixel off so that 0 is the border.
+ * Parameters:
+ * - mask: w x h bytes, non zero for obstacle pixels
+ * - seeds: the seeds after the last pass
+ * - w: the width of the world
+ * - h: the height of the world
+ * - sdf: w x h floats for the result
+ */
+__kernel void
+jfa_distance_kernel(__global const unsigned char * mask,
+										__global const int * seeds,
+										int w,
+										int h,
+										__global float * sdf)
+{
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	if (x >= w || y >= h) return;
+
+	__global const int * seed = seeds + (y * w + x) * 4;
+	int obstacle = mask[y * w + x] != 0;
+	int s_x = obstacle ? seed[2] : seed[0];
+	int s_y = obstacle ? seed[3] : seed[1];
+
+	float d = (s_x < 0) ? (float)(w + h) : hypot((float)(s_x - x), (float)(s_y - y)) - 0.5f;
+	sdf[y * w + x] = obstacle ? -d : d;
+}
+
+/* Paint the obstacles (the pixels with a negative distance) with `RGB`. Runs
+ * over the pixels of the frame.
+ * Parameters:
+ * - sdf: the signed distance field of the obstacles
+ * - w: the width of the world
+ * - h: the height of the world
+ * - pixels: the memory where the pixels of the host's pixbuf are stored
+ * - row_stride: the row_stride of the host's pixbuf
+ * - n_channels: the number of channels of each pixel in the host's pixbuf
+ * - rgb: an int containing three bytes for R, G, and B values for color
+ * - scale: frame pixels per world pixel
+ * - view_x: the x coordinate in the world of the left of the frame
+ * - view_y: the y coordinate in the world of the top of the frame
+ * Pixels outside the world are left alone.
+ */
+__kernel void
+draw_obstacles_kernel(__global const float * sdf,
+											int w,
+											int h,
+											__global unsigned char * pixels,
+											int row_stride,
+											int n_channels,
+											unsigned int RGB,
+											float scale,
+											float view_x,
+											float view_y)
+{
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int s_x = (int)floor(view_x + x / scale);
+	int s_y = (int)floor(view_y + y / scale);
+	if (s_x < 0 || s_y < 0 || s_x >= w || s_y >= h) return;
+	if (sdf[s_y * w + s_x] >= 0) return;
+
+	__global unsigned char * pixel = pixels + row_stride * y + n_channels * x;
+	if (n_channels == 4) {
+		*((__global unsigned int *) pixel) = RGB;
+	}
+	else {
+		pixel[0] = (unsigned char) ((RGB & 0xFF0000) >> 16);
+		pixel[1] = (unsigned char) ((RGB & 0x00FF00) >> 8);
+		pixel[2] = (unsigned char) (RGB & 0x0000FF);
+	}
+}